@@ -1,8 +1,10 @@
 #ifndef _BLOCK_POSTINGS_LIST_H
 #define _BLOCK_POSTINGS_LIST_H
 
+#include <cmath>
 #include <limits>
 #include <stdexcept>
+#include <unordered_map>
 #include <x86intrin.h>
 
 #include "util.hpp"
@@ -12,8 +14,13 @@
 #include "codecfactory.h"
 #include "bitpacking.h"
 #include "simdfastpfor.h"
+#include "simdbinarypacking.h"
+#include "variablebyte.h"
+#include "compositecodec.h"
 #include "deltautil.h"
 #include "compress_qmx.h"
+#include "compress_qmx_d4.h"
+#include "mapped_file.hpp"
 
 #include "sdsl/int_vector.hpp"
 #include "generic_rank.hpp"
@@ -22,9 +29,150 @@
 
 using namespace sdsl;
 
+// Position of the first value >= id in the sorted docids [begin,end).
+// Compares four docids per instruction (eight with AVX2); the sign bit is
+// flipped as SSE only compares signed integers.
+inline const uint32_t* simd_lower_bound(const uint32_t* begin,
+                                        const uint32_t* end,
+                                        const uint64_t id)
+{
+  if (id > std::numeric_limits<uint32_t>::max()) {
+    return end;
+  }
+  const uint32_t* cur = begin;
+#ifdef __AVX2__
+  const __m256i flip8 = _mm256_set1_epi32(0x80000000);
+  const __m256i key8 = _mm256_xor_si256(_mm256_set1_epi32((uint32_t)id), flip8);
+  for (; cur + 8 <= end; cur += 8) {
+    __m256i vals = _mm256_xor_si256(
+        _mm256_loadu_si256((const __m256i*)cur), flip8);
+    // lanes holding a docid below id, a prefix as the docids are sorted
+    int less = _mm256_movemask_ps(
+        _mm256_castsi256_ps(_mm256_cmpgt_epi32(key8, vals)));
+    if (less != 0xFF) {
+      return cur + __builtin_ctz(~less);
+    }
+  }
+#endif
+  const __m128i flip = _mm_set1_epi32(0x80000000);
+  const __m128i key = _mm_xor_si128(_mm_set1_epi32((uint32_t)id), flip);
+  for (; cur + 4 <= end; cur += 4) {
+    __m128i vals = _mm_xor_si128(_mm_loadu_si128((const __m128i*)cur), flip);
+    int less = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(vals, key)));
+    if (less != 0xF) {
+      return cur + __builtin_ctz(~less);
+    }
+  }
+  while (cur < end && *cur < id) {
+    cur++;
+  }
+  return cur;
+}
+
 template<uint64_t t_block_size>
 class block_postings_list;
 
+// Decoded blocks shared by the queries of a batch. Queries with a common
+// term mostly touch the same blocks of its list: the first one decodes a
+// block into the slab, the others read it in place. The slab holds room
+// for a fixed number of blocks and is allocated once; when it is full,
+// cursors decode blocks themselves until the cache is cleared between
+// queries. Not thread safe, each thread has its own.
+template<uint64_t t_block_size>
+class decoded_block_cache {
+  private:
+    struct block_entry {
+      const void* list;
+      uint64_t block;
+      bool has_freqs; // freqs are only decoded once a query asks for them
+    };
+    static const uint32_t EMPTY = std::numeric_limits<uint32_t>::max();
+
+    // docids and freqs of slot s start at s * t_block_size
+    std::vector<uint32_t, FastPForLib::cacheallocator> m_ids;
+    std::vector<uint32_t, FastPForLib::cacheallocator> m_freqs;
+    std::vector<block_entry> m_entries;
+    // open addressing index of the slots, twice their number
+    std::vector<uint32_t> m_index;
+    size_t m_size = 0;
+
+    size_t index_pos(const void* list, const uint64_t block) const {
+      uint64_t h = (uint64_t)(uintptr_t)list * 0x9E3779B97F4A7C15ULL
+                   ^ block * 0xC2B2AE3D27D4EB4FULL;
+      return (h ^ (h >> 29)) & (m_index.size() - 1);
+    }
+
+    // Slot of the block, a new one on a miss; EMPTY if it is missing and
+    // the slab is full
+    template<class t_list>
+    uint32_t slot_of(const t_list& list, const uint64_t block) {
+      size_t pos = index_pos(&list, block);
+      while (m_index[pos] != EMPTY) {
+        const block_entry& entry = m_entries[m_index[pos]];
+        if (entry.list == &list && entry.block == block)
+          return m_index[pos];
+        pos = (pos + 1) & (m_index.size() - 1);
+      }
+      if (m_size == m_entries.size())
+        return EMPTY;
+      m_index[pos] = m_size;
+      m_entries[m_size] = {&list, block, false};
+      list.decompress_docids(block, m_ids.data() + m_size * t_block_size);
+      return m_size++;
+    }
+
+  public:
+    // Sizes the slab for the given number of blocks, once
+    void allocate(const size_t blocks) {
+      if (m_entries.size() == blocks)
+        return;
+      m_ids.resize(blocks * t_block_size);
+      m_freqs.resize(blocks * t_block_size);
+      m_entries.resize(blocks);
+      size_t index_size = 1;
+      while (index_size < 2 * blocks)
+        index_size <<= 1;
+      m_index.assign(index_size, EMPTY);
+      m_size = 0;
+    }
+
+    size_t size() const { return m_size; }
+    bool full() const { return m_size == m_entries.size(); }
+
+    void clear() {
+      if (m_size == 0)
+        return;
+      std::fill(m_index.begin(), m_index.end(), EMPTY);
+      m_size = 0;
+    }
+
+    // Decoded docids of a block, nullptr when the slab is full
+    template<class t_list>
+    const uint32_t* docids(const t_list& list, const uint64_t block) {
+      uint32_t slot = slot_of(list, block);
+      if (slot == EMPTY)
+        return nullptr;
+      return m_ids.data() + slot * t_block_size;
+    }
+
+    // Decoded freqs of a block, nullptr when the slab is full
+    template<class t_list>
+    const uint32_t* freqs(const t_list& list, const uint64_t block) {
+      uint32_t slot = slot_of(list, block);
+      if (slot == EMPTY)
+        return nullptr;
+      uint32_t* freqs = m_freqs.data() + slot * t_block_size;
+      if (!m_entries[slot].has_freqs) {
+        list.decompress_freqs(block, freqs);
+        m_entries[slot].has_freqs = true;
+      }
+      return freqs;
+    }
+};
+
+template<uint64_t t_block_size>
+const uint32_t decoded_block_cache<t_block_size>::EMPTY;
+
 template<uint64_t t_block_size>
 class plist_iterator
 {
@@ -34,12 +182,20 @@ class plist_iterator
     typedef uint64_t                          value_type;
   public: // default implementation used. not necessary to list here
     plist_iterator() = default;
-    plist_iterator(const plist_iterator& pi) = default;
-    plist_iterator(plist_iterator&& pi) = default;
-    plist_iterator& operator=(const plist_iterator& pi) = default;
-    plist_iterator& operator=(plist_iterator&& pi) = default;
+    // the decoded block may be in the buffers of the copied cursor
+    plist_iterator(const plist_iterator& pi) { assign(pi); }
+    plist_iterator(plist_iterator&& pi) { assign(std::move(pi)); }
+    plist_iterator& operator=(const plist_iterator& pi) {
+      assign(pi);
+      return *this;
+    }
+    plist_iterator& operator=(plist_iterator&& pi) {
+      assign(std::move(pi));
+      return *this;
+    }
   public:
     plist_iterator(const list_type& l,size_t pos);
+    void reset(const list_type& l,size_t pos);
     plist_iterator& operator++();
     bool operator ==(const plist_iterator& b) const;
     bool operator !=(const plist_iterator& b) const;
@@ -49,7 +205,13 @@ class plist_iterator
     void skip_to_block_with_id(const uint64_t id);
     double block_max() const;
     double block_max(const uint64_t id) const {
-      return m_plist_ptr->m_block_maximums[id];
+      return m_plist_ptr->block_max(id);
+    }
+    uint32_t block_max_quanta() const {
+      return m_plist_ptr->block_max_quanta(m_cur_block_id);
+    }
+    uint32_t block_max_quanta(const uint64_t id) const {
+      return m_plist_ptr->block_max_quanta(id);
     }
     uint64_t block_rep() const { 
       return m_plist_ptr->block_rep(m_cur_block_id); 
@@ -64,8 +226,16 @@ class plist_iterator
     size_t size() const { return m_plist_ptr->size(); }
     size_t remaining() const { return size() - m_cur_pos; }
     size_t offset() const { return m_cur_pos; }
+    // Blocks are taken from cache, decoding only the ones it lacks.
+    // reset() detaches the cursor again.
+    void set_block_cache(decoded_block_cache<t_block_size>* cache) {
+      m_block_cache = cache;
+    }
   private:
+    template<class t_other>
+    void assign(t_other&& pi);
     void access_and_decode_cur_pos() const;
+    void decode_block_docids() const;
   private:
     size_type m_cur_pos = std::numeric_limits<uint64_t>::max();
     mutable size_type m_cur_block_id = std::numeric_limits<uint64_t>::max();
@@ -74,10 +244,17 @@ class plist_iterator
     mutable size_type m_last_accessed_id = 
             std::numeric_limits<uint64_t>::max()-1;
     mutable value_type m_cur_docid = 0;
-    mutable value_type m_cur_freq = 0;
+    // freqs are only decoded once freq() is called in a block
+    mutable size_type m_last_freq_block =
+            std::numeric_limits<uint64_t>::max()-1;
     const list_type* m_plist_ptr = nullptr;
     mutable std::vector<uint32_t, FastPForLib::cacheallocator> m_decoded_ids;
     mutable std::vector<uint32_t, FastPForLib::cacheallocator> m_decoded_freqs;
+    // the decoded block, in the buffers above or in the block cache
+    mutable const uint32_t* m_ids = nullptr;
+    mutable size_type m_ids_len = 0;
+    mutable const uint32_t* m_freqs = nullptr;
+    decoded_block_cache<t_block_size>* m_block_cache = nullptr;
 };
 
 template<uint64_t t_block_size=128>
@@ -85,33 +262,67 @@ class block_postings_list {
 	static_assert(t_block_size % 32 == 0,"blocksize must be multiple of 32.");
   public: // types
 	  friend class plist_iterator<t_block_size>;
-	  using comp_codec = ANT_compress_qmx;
-	  using freq_codec = ANT_compress_qmx;
+	  using bp128_codec = FastPForLib::CompositeCodec<
+	                        FastPForLib::SIMDBinaryPacking,
+	                        FastPForLib::VariableByte>;
+	  using fastpfor_codec = FastPForLib::CompositeCodec<
+	                           FastPForLib::SIMDFastPFor<4>,
+	                           FastPForLib::VariableByte>;
 	  using size_type = sdsl::int_vector<>::size_type;
 	  using const_iterator = plist_iterator<t_block_size>;
+	  using block_cache_type = decoded_block_cache<t_block_size>;
 	  using pfor_data_type = std::vector<uint32_t, FastPForLib::cacheallocator>;
-	  #pragma pack(push, 1)
+	  using pfor_store_type = mappable_vector<uint32_t, FastPForLib::cacheallocator>;
+	  // Variable sized blocks are multiples of this many postings
+	  static const size_t VARIABLE_BLOCK_STEP = 16;
+	  // Where the compressed block lives. Only touched once a block is
+	  // decoded, skipping uses the block reps and maximums alone.
 	  struct block_data {
-		  uint32_t max_block_id = 0;
 		  uint32_t id_offset = 0;
 		  uint32_t freq_offset = 0;
 		  uint32_t id_bytes = -1;
 		  uint32_t freq_bytes = -1;
 	  };
-	  #pragma pack(pop)
   public: // actual data
 	  uint64_t m_size = 0;
+	  uint8_t m_codec = QMX;
 	  double m_list_maximum = std::numeric_limits<double>::lowest();
-	  std::vector<block_data> m_block_data;
-    pfor_data_type m_docid_data;
-    pfor_data_type m_freq_data;
-    std::vector<double> m_block_maximums;
+	  // skip arrays: last docid and (BMW only) max score of every block.
+	  // The maximums are floats, or quanta of m_block_max_scale when
+	  // m_block_max_bits is 8 or 16.
+	  mappable_vector<uint32_t> m_block_reps;
+	  uint8_t m_block_max_bits = 0;
+	  double m_block_max_scale = 1.0;
+	  mappable_vector<float> m_block_maximums;
+	  mappable_vector<uint8_t> m_block_maximums_u8;
+	  mappable_vector<uint16_t> m_block_maximums_u16;
+	  mappable_vector<block_data> m_block_data;
+	  // first posting of every block and the list size, only stored when
+	  // the list was partitioned into variable sized blocks
+	  mappable_vector<uint32_t> m_block_starts;
+    pfor_store_type m_docid_data;
+    pfor_store_type m_freq_data;
   public: // default 
     block_postings_list() {
+    	m_block_reps.resize(1);
     	m_block_data.resize(1);
     }
     const double block_max(const uint64_t bid) const {
-      return m_block_maximums[bid];
+      switch (m_block_max_bits) {
+        case 8: return m_block_max_scale * m_block_maximums_u8[bid];
+        case 16: return m_block_max_scale * m_block_maximums_u16[bid];
+        default: return m_block_maximums[bid];
+      }
+    }
+    // Integer block maximum, only meaningful for quantized maximums
+    const uint32_t block_max_quanta(const uint64_t bid) const {
+      return m_block_max_bits == 8 ? m_block_maximums_u8[bid]
+                                   : m_block_maximums_u16[bid];
+    }
+    // Whether the block maximums are exact integer scores, which holds
+    // for impact scored lists whose maximum fits the quanta
+    bool integer_block_max() const {
+      return m_block_max_bits != 0 && m_block_max_scale == 1.0;
     }
 
     block_postings_list(const block_postings_list& pl) = default;
@@ -124,13 +335,24 @@ public: // constructors
       load(in);
     }
 
+    // View over a list serialized at ptr inside a mapped index file
+    block_postings_list(const char* ptr) {
+      map(ptr);
+    }
+
  
-    block_postings_list(const std::unique_ptr<generic_rank> &ranker,
+    // block_max_bits of 8 or 16 quantizes the block maximums of BMW
+    // lists, 0 keeps them as floats. A variable_block_avg other than 0
+    // partitions BMW lists into blocks of VARIABLE_BLOCK_STEP up to
+    // t_block_size postings, with variable_block_avg postings per block
+    // on average at most.
+    template<class t_rank>
+    block_postings_list(const std::unique_ptr<t_rank> &ranker,
                         std::vector<std::pair<uint64_t,uint64_t>>& pre_sorted_data,
-                        index_form index_type) {
-
-    	m_size = pre_sorted_data.size();
-
+                        index_form index_type,
+                        const uint8_t block_max_bits = 0,
+                        const postings_codec codec = QMX,
+                        const size_t variable_block_avg = 0) {
 	    // extract doc_ids and freqs
 	    sdsl::int_vector<32> tmp_data(pre_sorted_data.size());
 	    sdsl::int_vector<32> tmp_freq(pre_sorted_data.size());
@@ -138,44 +360,125 @@ public: // constructors
 	        tmp_data[i] = pre_sorted_data[i].first;
 	        tmp_freq[i] = pre_sorted_data[i].second;
 	    }
+	    build(ranker, tmp_data, tmp_freq, index_type, block_max_bits, codec,
+	          variable_block_avg);
+    }
+
+    // Same from docid sorted ids and the freqs (or impacts) of each. The
+    // vectors are used as scratch space, ids end up as d-gaps.
+    template<class t_rank>
+    block_postings_list(const std::unique_ptr<t_rank> &ranker,
+                        sdsl::int_vector<32>& ids,
+                        sdsl::int_vector<32>& freqs,
+                        index_form index_type,
+                        const uint8_t block_max_bits = 0,
+                        const postings_codec codec = QMX,
+                        const size_t variable_block_avg = 0) {
+	    build(ranker, ids, freqs, index_type, block_max_bits, codec,
+	          variable_block_avg);
+    }
+  
+  private: // functions used during construction
+    template<class t_rank>
+    void build(const std::unique_ptr<t_rank> &ranker,
+               sdsl::int_vector<32>& tmp_data,
+               sdsl::int_vector<32>& tmp_freq,
+               index_form index_type,
+               const uint8_t block_max_bits,
+               const postings_codec codec,
+               const size_t variable_block_avg) {
+
+    	m_size = tmp_data.size();
+    	m_codec = codec;
 
-      // Generic
-	    create_block_support(tmp_data);
-        
       if (index_type == BMW) {
-        // BMW specific
-        create_rank_support_bmw(tmp_data,tmp_freq, ranker);
+        // BMW specific, also places the blocks
+        create_rank_support_bmw(tmp_data,tmp_freq, ranker, block_max_bits,
+                                variable_block_avg);
       }
       else {
         // Wand specific
         create_rank_support_wand(tmp_data,tmp_freq, ranker);
       }
 
+      // Generic
+	    m_block_reps = create_block_support(tmp_data);
+	    std::vector<block_data> blocks(m_block_reps.size());
+
 	    // compress postings
-	    compress_postings_data(tmp_data,tmp_freq);
+	    compress_postings_data(tmp_data,tmp_freq,blocks);
+	    m_block_data = std::move(blocks);
    }
-  
-  private: // functions used during construction
-	  void create_block_support(const sdsl::int_vector<32>& ids)
+
+	  std::vector<uint32_t> create_block_support(const sdsl::int_vector<32>& ids)
 	  {
+	    if (!m_block_starts.empty()) {
+	      std::vector<uint32_t> block_reps(m_block_starts.size() - 1);
+	      for (size_t b=0; b<block_reps.size(); b++) {
+	        block_reps[b] = ids[m_block_starts[b+1] - 1];
+	      }
+	      return block_reps;
+	    }
 	    size_t num_blocks = ids.size() / t_block_size;
 	    if (ids.size() % t_block_size != 0) num_blocks++;
-	    m_block_data.resize(num_blocks);
+	    std::vector<uint32_t> block_reps(num_blocks);
 	    size_t j = 0;
 	    for (size_t i=t_block_size-1; i<ids.size(); i+=t_block_size) {
-	      m_block_data[j++].max_block_id = ids[i];
+	      block_reps[j++] = ids[i];
 	    }
 	    if (ids.size() % t_block_size != 0) {
-        m_block_data[j].max_block_id = ids[ids.size()-1];
+        block_reps[j] = ids[ids.size()-1];
       }
+	    return block_reps;
+	  }
+
+	  // Narrows a score bound to float, rounding up so it stays a bound
+	  static float float_upper_bound(const double score)
+	  {
+	    float bound = score;
+	    if (bound < score) {
+	      bound = std::nextafter(bound, std::numeric_limits<float>::max());
+	    }
+	    return bound;
 	  }
 
+	  // Maps the block maximums onto quanta of t_quanta on a linear scale
+	  // reaching the list maximum. Integer scores up to the largest quantum
+	  // keep a scale of 1 and stay exact, everything else rounds up so the
+	  // scaled quantum is still a bound of its block.
+	  template<class t_quanta>
+	  std::vector<t_quanta>
+	  quantize_block_maximums(const std::vector<double>& block_maximums)
+	  {
+	    const t_quanta qmax = std::numeric_limits<t_quanta>::max();
+	    m_block_max_scale = 1.0;
+	    if (m_list_maximum > qmax ||
+	        m_list_maximum != std::floor(m_list_maximum)) {
+	      m_block_max_scale = m_list_maximum / qmax;
+	      while (m_block_max_scale * qmax < m_list_maximum) {
+	        m_block_max_scale = std::nextafter(m_block_max_scale,
+	                                           std::numeric_limits<double>::max());
+	      }
+	    }
+	    std::vector<t_quanta> quanta(block_maximums.size());
+	    for (size_t b=0; b<block_maximums.size(); b++) {
+	      double q = std::ceil(block_maximums[b] / m_block_max_scale);
+	      q = std::min<double>(std::max(q, 0.0), qmax);
+	      while (q < qmax && m_block_max_scale * q < block_maximums[b]) {
+	        q++;
+	      }
+	      quanta[b] = q;
+	    }
+	    return quanta;
+	  }
+
+	  template<class t_rank>
 	  void create_rank_support_wand(const sdsl::int_vector<32>& ids,
 							               const sdsl::int_vector<32>& freqs,
-                             const std::unique_ptr<generic_rank>& ranker)
+                             const std::unique_ptr<t_rank>& ranker)
 	  {
-		  auto F_t = std::accumulate(freqs.begin(),freqs.end(),0);
 		  uint64_t f_t = ids.size();
+		  double w_qt = ranker->term_weight(f_t);
       
       double max_score = 0;
       m_list_maximum = std::numeric_limits<double>::lowest();
@@ -183,68 +486,244 @@ public: // constructors
 	    for (size_t l=0; l<ids.size(); l++) {
 	      uint64_t id = ids[l];
 	      uint64_t f_dt = freqs[l];
-        double W_d = ranker->doc_length(id);
-        double score = ranker->calculate_docscore(f_dt, f_t, W_d);
+        double score = ranker->score(f_dt, w_qt, ranker->doc_norm(id));
 	      max_score = std::max(max_score, score);
       }
       m_list_maximum = std::max(m_list_maximum, max_score);
 	  }
 
 
+	  // Optimal partition of the scores into blocks of 1 to
+	  // t_block_size / VARIABLE_BLOCK_STEP steps, minimising the summed
+	  // block-max error (block max * length - score sum) plus a cost of
+	  // penalty per block. Returns the block starts and the list size.
+	  static std::vector<uint32_t>
+	  partition_blocks(const std::vector<double>& step_max,
+	                   const std::vector<double>& step_sum,
+	                   const size_t size, const double penalty)
+	  {
+	    const size_t num_steps = step_max.size();
+	    const size_t max_steps = t_block_size / VARIABLE_BLOCK_STEP;
+	    std::vector<double> cost(num_steps + 1, 0.0);
+	    std::vector<size_t> block_steps(num_steps + 1, 0);
+	    for (size_t j=1; j<=num_steps; j++) {
+	      double block_max = 0;
+	      double block_sum = 0;
+	      cost[j] = std::numeric_limits<double>::max();
+	      for (size_t l=1; l<=std::min(max_steps, j); l++) {
+	        block_max = std::max(block_max, step_max[j-l]);
+	        block_sum += step_sum[j-l];
+	        size_t len = std::min(j * VARIABLE_BLOCK_STEP, size)
+	                     - (j-l) * VARIABLE_BLOCK_STEP;
+	        double c = cost[j-l] + block_max * len - block_sum + penalty;
+	        // ties go to the longer block
+	        if (c <= cost[j]) {
+	          cost[j] = c;
+	          block_steps[j] = l;
+	        }
+	      }
+	    }
+	    std::vector<uint32_t> starts;
+	    for (size_t j=num_steps; j>0; j-=block_steps[j]) {
+	      starts.push_back(std::min(j * VARIABLE_BLOCK_STEP, size));
+	    }
+	    starts.push_back(0);
+	    std::reverse(starts.begin(), starts.end());
+	    return starts;
+	  }
+
+	  // Score-aware block boundaries: the least block-max error with at
+	  // most size / avg_block_size blocks, found by bisecting the cost of a
+	  // block. Falls back to fixed blocks when that is what it finds.
+	  void create_variable_blocks(const std::vector<double>& scores,
+	                              const size_t avg_block_size)
+	  {
+	    const size_t size = scores.size();
+	    const size_t num_steps = (size + VARIABLE_BLOCK_STEP - 1)
+	                             / VARIABLE_BLOCK_STEP;
+	    std::vector<double> step_max(num_steps, 0.0);
+	    std::vector<double> step_sum(num_steps, 0.0);
+	    for (size_t l=0; l<size; l++) {
+	      step_max[l / VARIABLE_BLOCK_STEP] =
+	          std::max(step_max[l / VARIABLE_BLOCK_STEP], scores[l]);
+	      step_sum[l / VARIABLE_BLOCK_STEP] += scores[l];
+	    }
+	    size_t budget = (size + avg_block_size - 1) / avg_block_size;
+	    budget = std::max<size_t>(budget,
+	                              (size + t_block_size - 1) / t_block_size);
+
+	    auto starts = partition_blocks(step_max, step_sum, size, 0.0);
+	    if (starts.size() - 1 > budget) {
+	      // a block costing more than any block error only merges
+	      double lo = 0.0;
+	      double hi = std::max(m_list_maximum, 1.0) * t_block_size;
+	      starts = partition_blocks(step_max, step_sum, size, hi);
+	      for (size_t iter=0; iter<32; iter++) {
+	        double mid = lo + (hi - lo) / 2;
+	        auto candidate = partition_blocks(step_max, step_sum, size, mid);
+	        if (candidate.size() - 1 <= budget) {
+	          hi = mid;
+	          starts = std::move(candidate);
+	        } else {
+	          lo = mid;
+	        }
+	      }
+	    }
+
+	    bool fixed = true;
+	    for (size_t b=0; b<starts.size(); b++) {
+	      fixed = fixed && starts[b] == std::min(b * t_block_size, size);
+	    }
+	    if (fixed) {
+	      m_block_starts = std::vector<uint32_t>();
+	    } else {
+	      m_block_starts = std::move(starts);
+	    }
+	  }
+
+	  template<class t_rank>
 	  void create_rank_support_bmw(const sdsl::int_vector<32>& ids,
 							               const sdsl::int_vector<32>& freqs,
-                             const std::unique_ptr<generic_rank>& ranker)
+                             const std::unique_ptr<t_rank>& ranker,
+                             const uint8_t block_max_bits,
+                             const size_t variable_block_avg)
 	  {
-		  auto F_t = std::accumulate(freqs.begin(),freqs.end(),0);
 		  auto f_t = ids.size();
-      
-      size_t num_blocks = ids.size() / t_block_size;
-      if(ids.size() % t_block_size != 0)
-        num_blocks++;
+		  double w_qt = ranker->term_weight(f_t);
 
-      m_block_maximums.resize(num_blocks);
-      double max_score = 0;
-      m_list_maximum = std::numeric_limits<double>::lowest();
-      size_t i = 1;
-      size_t j = 0;
-  
+      std::vector<double> scores(ids.size());
+      m_list_maximum = 0;
 	    for (size_t l=0; l<ids.size(); l++) {
 	      auto id = ids[l];
 	      uint64_t f_dt = freqs[l];
-        double W_d = ranker->doc_length(id);
-        double score = ranker->calculate_docscore(f_dt, f_t, W_d);
-	      max_score = std::max(max_score, score);
-        //Block max support
-        if(i % t_block_size == 0){
-          m_block_maximums[j] = max_score;
-          m_list_maximum = std::max(m_list_maximum, max_score);
-          i = 0;
-          max_score = 0.0f;
-          j++;
+        scores[l] = ranker->score(f_dt, w_qt, ranker->doc_norm(id));
+        m_list_maximum = std::max(m_list_maximum, scores[l]);
+      }
+
+      if (variable_block_avg != 0) {
+        create_variable_blocks(scores, variable_block_avg);
+      }
+
+      //Block max support
+      size_t num_blocks = m_block_starts.empty()
+          ? (ids.size() + t_block_size - 1) / t_block_size
+          : m_block_starts.size() - 1;
+      std::vector<double> block_maximums(num_blocks, 0.0);
+      for (size_t b=0; b<num_blocks; b++) {
+        size_t end = b + 1 < num_blocks ? block_start(b+1) : ids.size();
+        for (size_t l=block_start(b); l<end; l++) {
+          block_maximums[b] = std::max(block_maximums[b], scores[l]);
         }
-        i++;
       }
-      if (ids.size() % t_block_size != 0){
-        m_block_maximums[num_blocks-1] = max_score;
+      m_block_max_bits = block_max_bits;
+      if (block_max_bits == 8) {
+        m_block_maximums_u8 = quantize_block_maximums<uint8_t>(block_maximums);
+        return;
       }
-      m_list_maximum = std::max(m_list_maximum, max_score);
+      if (block_max_bits == 16) {
+        m_block_maximums_u16 = quantize_block_maximums<uint16_t>(block_maximums);
+        return;
+      }
+      m_block_max_bits = 0;
+      std::vector<float> block_bounds(num_blocks);
+      for (size_t b=0; b<num_blocks; b++) {
+        block_bounds[b] = float_upper_bound(block_maximums[b]);
+      }
+      m_block_maximums = std::move(block_bounds);
 	  }
 
-	  void compress_postings_data(const sdsl::int_vector<32>& ids,
-	            					        sdsl::int_vector<32>& freqs)
+	  // D4 differences the docids itself, its freqs use plain QMX
+	  static postings_codec freq_codec(const uint8_t codec) {
+	    return codec == QMX_D4 ? QMX : (postings_codec)codec;
+	  }
+
+	  // Encodes n integers into out, which has room for capacity
+	  // integers. Returns the bytes used.
+	  static uint64_t encode_block(const uint8_t codec, const uint32_t* in,
+	                               const size_t n, uint32_t* out,
+	                               const size_t capacity)
+	  {
+	    // the encoders keep state, lists may be built on several threads
+	    static thread_local ANT_compress_qmx qmx;
+	    static thread_local ANT_compress_qmx_d4 qmx_d4;
+	    static thread_local bp128_codec bp128;
+	    static thread_local fastpfor_codec fastpfor;
+	    static thread_local FastPForLib::VariableByte vbyte;
+
+	    uint64_t bytes_used = 0;
+	    size_t words_used = capacity;
+	    switch (codec) {
+	      case QMX:
+	        qmx.encodeArray(in, n, out, &bytes_used);
+	        return bytes_used;
+	      case QMX_D4:
+	        qmx_d4.encodeArray(in, n, out, &bytes_used);
+	        return bytes_used;
+	      case SIMD_BP128:
+	        bp128.encodeArray(in, n, out, words_used);
+	        break;
+	      case SIMD_FASTPFOR:
+	        fastpfor.encodeArray(in, n, out, words_used);
+	        break;
+	      default:
+	        vbyte.encodeArray(in, n, out, words_used);
+	        break;
+	    }
+	    return words_used * sizeof(uint32_t);
+	  }
+
+	  // Decodes n integers from the bytes at in. The FastPFor codecs keep
+	  // state, so every query thread has its own.
+	  static void decode_block(const uint8_t codec, const uint32_t* in,
+	                           const uint64_t bytes, uint32_t* out,
+	                           const size_t n)
 	  {
-		  static comp_codec c;
-		  static freq_codec fc;
+	    static ANT_compress_qmx qmx;
+	    static ANT_compress_qmx_d4 qmx_d4;
+	    static thread_local bp128_codec bp128;
+	    static thread_local fastpfor_codec fastpfor;
+	    static thread_local FastPForLib::VariableByte vbyte;
+
+	    size_t decoded = n;
+	    switch (codec) {
+	      case QMX:
+	        qmx.decodeArray(in, bytes, out, n);
+	        break;
+	      case QMX_D4:
+	        qmx_d4.decodeArray(in, bytes, out, n);
+	        break;
+	      case SIMD_BP128:
+	        bp128.decodeArray(in, bytes / sizeof(uint32_t), out, decoded);
+	        break;
+	      case SIMD_FASTPFOR:
+	        fastpfor.decodeArray(in, bytes / sizeof(uint32_t), out, decoded);
+	        break;
+	      default:
+	        vbyte.decodeArray(in, bytes / sizeof(uint32_t), out, decoded);
+	        break;
+	    }
+	  }
 
+	  void compress_postings_data(const sdsl::int_vector<32>& ids,
+	            					        sdsl::int_vector<32>& freqs,
+	            					        std::vector<block_data>& blocks)
+	  {
 		  uint32_t *id_input = (uint32_t *)ids.data();
-		  FastPForLib::Delta::fastDelta(id_input,ids.size());
+		  // D4 takes docids relative to the end of the previous block,
+		  // the other codecs take d-gaps
+		  pfor_data_type d4_block;
+		  if (m_codec == QMX_D4) {
+		    d4_block.resize(t_block_size);
+		  } else {
+		    FastPForLib::Delta::fastDelta(id_input,ids.size());
+		  }
 		  uint32_t *freq_input = (uint32_t *)freqs.data();
 
-		  m_docid_data.resize(2 * ids.size() + 1024);
-		  m_freq_data.resize(2 * freqs.size() + 1024);
+		  pfor_data_type docid_data(2 * ids.size() + 1024);
+		  pfor_data_type freq_data(2 * freqs.size() + 1024);
 
-		  uint32_t *id_out = m_docid_data.data();
-		  uint32_t *freq_out = m_freq_data.data();
+		  uint32_t *id_out = docid_data.data();
+		  uint32_t *freq_out = freq_data.data();
 
 		  size_type cur_block = 0;
 		  uint64_t id_offset = 0;
@@ -254,15 +733,25 @@ public: // constructors
 		  uint64_t bytes_used = 0;
 		  uint64_t freq_bytes_used = 0;
 
-		  size_type n = t_block_size;
-		  for (size_t i = 0; i < ids.size(); i+=t_block_size) {
-			  if (i + t_block_size > ids.size())
-				  n = ids.size() % t_block_size;
-
-			  m_block_data[cur_block].id_offset = id_offset;
-			  m_block_data[cur_block].freq_offset = freq_offset;
-			  c.encodeArray(&id_input[i], n, &id_out[id_offset], &bytes_used);
-			  fc.encodeArray(&freq_input[i], n, &freq_out[freq_offset], &freq_bytes_used);
+		  size_type n = 0;
+		  for (size_t i = 0; i < ids.size(); i+=n) {
+			  n = postings_in_block(cur_block);
+
+			  blocks[cur_block].id_offset = id_offset;
+			  blocks[cur_block].freq_offset = freq_offset;
+			  const uint32_t *block_ids = &id_input[i];
+			  if (m_codec == QMX_D4) {
+			    uint32_t base = cur_block == 0 ? 0 : m_block_reps[cur_block-1];
+			    for (size_t j = 0; j < n; j++) {
+			      d4_block[j] = id_input[i+j] - base;
+			    }
+			    block_ids = d4_block.data();
+			  }
+			  bytes_used = encode_block(m_codec, block_ids, n, &id_out[id_offset],
+			                            docid_data.size() - id_offset);
+			  freq_bytes_used = encode_block(freq_codec(m_codec), &freq_input[i], n,
+			                                 &freq_out[freq_offset],
+			                                 freq_data.size() - freq_offset);
 
 			  id_offset += (bytes_used / sizeof(uint32_t));
 			  freq_offset += (freq_bytes_used / sizeof(uint32_t));
@@ -280,72 +769,126 @@ public: // constructors
 			  if (freq_offset % alignment != 0) {
 				  freq_offset += alignment - (freq_offset % alignment);
 			  }
-			  if (id_offset > m_docid_data.size() || freq_offset > m_freq_data.size()) {
+			  if (id_offset > docid_data.size() || freq_offset > freq_data.size()) {
 				  std::cerr << "Run out of room encoding!" << std::endl;
 				  exit(EXIT_FAILURE);
 			  }
-			  m_block_data[cur_block].id_bytes = bytes_used;
-			  m_block_data[cur_block].freq_bytes = freq_bytes_used;
+			  blocks[cur_block].id_bytes = bytes_used;
+			  blocks[cur_block].freq_bytes = freq_bytes_used;
 
 			  cur_block++;
 		  }
 
-		  m_docid_data.resize(id_offset);
-		  m_docid_data.shrink_to_fit();
-		  m_freq_data.resize(freq_offset);
-		  m_freq_data.shrink_to_fit();
+		  docid_data.resize(id_offset);
+		  docid_data.shrink_to_fit();
+		  freq_data.resize(freq_offset);
+		  freq_data.shrink_to_fit();
+		  m_docid_data = std::move(docid_data);
+		  m_freq_data = std::move(freq_data);
 	  }
   public: // functions used during processing
 	  
-    void decompress_block(const size_t block_id,
-	            					  pfor_data_type& id_data,
-						              pfor_data_type& freq_data) const
+    void decompress_docids(const size_t block_id,
+                           pfor_data_type& id_data) const
 	{
-		static comp_codec c;
-		static freq_codec fc;
+		id_data.resize(postings_in_block(block_id));
+		decompress_docids(block_id, id_data.data());
+	}
 
+    // Decodes into id_data, which has room for t_block_size docids
+    void decompress_docids(const size_t block_id, uint32_t* id_data) const
+	{
 		uint32_t delta_offset = 0;
 		if (block_id != 0) {
-			delta_offset = m_block_data[block_id - 1].max_block_id;
+			delta_offset = m_block_reps[block_id - 1];
 		}
 
 		const uint32_t *id_start = m_docid_data.data() + m_block_data[block_id].id_offset;
-		const uint32_t *freq_start = m_freq_data.data() + m_block_data[block_id].freq_offset;
 		auto block_size = postings_in_block(block_id);
 
-		if (id_data.size() != block_size) {
-			id_data.resize(block_size);
-			freq_data.resize(block_size);
+		if (m_codec == QMX_D4) {
+			// D4 writes whole runs past the end of the block, so it decodes
+			// into scratch space. The values are docids relative to the end
+			// of the previous block.
+			static thread_local pfor_data_type d4_scratch(t_block_size + 256);
+			decode_block(m_codec, id_start, m_block_data[block_id].id_bytes, d4_scratch.data(), block_size);
+			__m128i base = _mm_set1_epi32(delta_offset);
+			size_t i = 0;
+			for (; i < block_size/4; i++) {
+				__m128i curr = _mm_load_si128((const __m128i *)d4_scratch.data() + i);
+				_mm_storeu_si128((__m128i *)id_data + i, _mm_add_epi32(curr, base));
+			}
+			for (i = 4 * i; i < block_size; ++i) {
+				id_data[i] = d4_scratch[i] + delta_offset;
+			}
+			return;
 		}
 
-		c.decodeArray(id_start, m_block_data[block_id].id_bytes, id_data.data(), block_size);
+		decode_block(m_codec, id_start, m_block_data[block_id].id_bytes, id_data, block_size);
 
 		/* Extracted from: https:github.com/lemire/FastDifferentialCoding */
 		__m128i prev = _mm_set1_epi32(delta_offset);
 		size_t i = 0;
 		for (; i  < block_size/4; i++) {
-			__m128i curr = _mm_lddqu_si128((const __m128i *)id_data.data() + i);
+			__m128i curr = _mm_lddqu_si128((const __m128i *)id_data + i);
 			const __m128i _tmp1 = _mm_add_epi32(_mm_slli_si128(curr, 8), curr);
 			const __m128i _tmp2 = _mm_add_epi32(_mm_slli_si128(_tmp1, 4), _tmp1);
 			prev = _mm_add_epi32(_tmp2, _mm_shuffle_epi32(prev, 0xff));
-			_mm_storeu_si128((__m128i *)id_data.data() + i,prev);
+			_mm_storeu_si128((__m128i *)id_data + i,prev);
 		}
 		uint32_t lastprev = _mm_extract_epi32(prev, 3);
 		for(i = 4 * i ; i < block_size; ++i) {
 			lastprev = lastprev + id_data[i];
 			id_data[i] = lastprev;
 		}
+	}
 
-		fc.decodeArray(freq_start, m_block_data[block_id].freq_bytes, freq_data.data(), block_size);
+    // Kept apart from the docids since most blocks touched while
+    // forwarding are never scored
+    void decompress_freqs(const size_t block_id,
+                          pfor_data_type& freq_data) const
+	{
+		freq_data.resize(postings_in_block(block_id));
+		decompress_freqs(block_id, freq_data.data());
 	}
 
+    void decompress_freqs(const size_t block_id, uint32_t* freq_data) const
+	{
+		const uint32_t *freq_start = m_freq_data.data() + m_block_data[block_id].freq_offset;
+		auto block_size = postings_in_block(block_id);
+
+		decode_block(freq_codec(m_codec), freq_start, m_block_data[block_id].freq_bytes, freq_data, block_size);
+	}
+
+	  // Galloping search for the first block from start_block on whose last
+	  // docid is >= id. Forwarding mostly moves a few blocks, so the search
+	  // doubles its stride from the start instead of bisecting the list,
+	  // and finishes with a vectorized scan over the block reps.
 	  size_type find_block_with_id(const uint64_t id, const size_t start_block) const {
-	    size_t block_id = start_block;
-	    size_t nblocks = m_block_data.size();
-	    while (block_id < nblocks && m_block_data[block_id].max_block_id < id) {
-	      block_id++;
+	    const uint32_t* reps = m_block_reps.data();
+	    size_t nblocks = m_block_reps.size();
+	    if (start_block >= nblocks || reps[start_block] >= id) {
+	      return start_block;
+	    }
+	    // invariant: block lo ends before id, block hi (if any) does not
+	    size_t lo = start_block;
+	    size_t step = 1;
+	    size_t hi = lo + step;
+	    while (hi < nblocks && reps[hi] < id) {
+	      lo = hi;
+	      step *= 2;
+	      hi = lo + step;
 	    }
-	    return block_id;
+	    hi = std::min(hi, nblocks);
+	    while (hi - lo > 32) {
+	      size_t mid = lo + (hi - lo) / 2;
+	      if (reps[mid] < id) {
+	        lo = mid;
+	      } else {
+	        hi = mid;
+	      }
+	    }
+	    return simd_lower_bound(reps + lo + 1, reps + hi, id) - reps;
 	  }
 
 	  size_type size() const {
@@ -353,17 +896,48 @@ public: // constructors
 	  }
 
 	  uint64_t block_rep(const size_t bid) const {
-		  return m_block_data[bid].max_block_id;
+		  return m_block_reps[bid];
 	  }
 
 	  size_type num_blocks() const {
-		  return m_block_data.size();
+		  return m_block_reps.size();
+	  }
+
+	  // Position of the first posting of block bid
+	  size_type block_start(const size_type bid) const {
+		  if (m_block_starts.empty()) {
+			  return bid * t_block_size;
+		  }
+		  return m_block_starts[bid];
+	  }
+
+	  // Block holding position pos. Iterators move forward, so variable
+	  // blocks are scanned from the last block the iterator decoded.
+	  size_type block_of_pos(const size_type pos, const size_type hint) const {
+		  if (m_block_starts.empty()) {
+			  return pos / t_block_size;
+		  }
+		  size_type bid;
+		  if (hint < num_blocks() && m_block_starts[hint] <= pos) {
+			  bid = hint;
+			  while (m_block_starts[bid+1] <= pos) {
+				  bid++;
+			  }
+		  } else {
+			  bid = std::upper_bound(m_block_starts.data(),
+			                         m_block_starts.data() + num_blocks(), pos)
+			        - m_block_starts.data() - 1;
+		  }
+		  return bid;
 	  }
 
 	  size_type postings_in_block(const size_type block_id) const {
+		  if (!m_block_starts.empty()) {
+			  return m_block_starts[block_id+1] - m_block_starts[block_id];
+		  }
 		  size_type block_size = t_block_size;
 		  size_type mod = m_size % t_block_size;
-		  if (block_id == m_block_data.size()-1 && mod != 0) {
+		  if (block_id == m_block_reps.size()-1 && mod != 0) {
 			  block_size = mod;
 		  }
 		  return block_size;
@@ -395,13 +969,37 @@ public: // constructors
 	    }
 
 	    written_bytes += sdsl::write_member(m_size,out,child,"size");
-
-	    if (m_size <= t_block_size) { // only one block
-	     	written_bytes += sdsl::write_member(m_block_data[0].max_block_id,out,
+	    written_bytes += sdsl::write_member(m_codec,out,child,"codec");
+	    uint8_t variable_blocks = !m_block_starts.empty();
+	    written_bytes += sdsl::write_member(variable_blocks,out,child,
+	                                        "variable blocks");
+
+	    if (variable_blocks) {
+	    	uint64_t num_blocks = m_block_reps.size();
+	    	written_bytes += sdsl::write_member(num_blocks,out,child,
+	    	                                    "num blocks");
+	    	auto* blockstarts = sdsl::structure_tree::add_child(child,
+	    	                        "block starts", "uint32");
+	    	out.write((const char*)m_block_starts.data(),
+	    	          m_block_starts.size()*sizeof(uint32_t));
+	    	written_bytes += m_block_starts.size()*sizeof(uint32_t);
+	    	sdsl::structure_tree::add_size(blockstarts,
+	    	                               m_block_starts.size()*sizeof(uint32_t));
+	    }
+	    if (!variable_blocks && m_size <= t_block_size) { // only one block
+	     	written_bytes += sdsl::write_member(m_block_reps[0],out,
                                             child,"max block id");
 			written_bytes += sdsl::write_member(m_block_data[0].id_bytes, out, child, "id bytes used");
 			written_bytes += sdsl::write_member(m_block_data[0].freq_bytes, out, child, "freq bytes used");
 	    } else {
+	    	// block reps first, a skip never has to read the block data
+	    	auto* blockreps = sdsl::structure_tree::add_child(child, "block reps",
+                                                          "uint32");
+	    	out.write((const char*)m_block_reps.data(),
+                  m_block_reps.size()*sizeof(uint32_t));
+	    	written_bytes += m_block_reps.size()*sizeof(uint32_t);
+	    	sdsl::structure_tree::add_size(blockreps,
+                                       m_block_reps.size()*sizeof(uint32_t));
 	    	auto* blockdata = sdsl::structure_tree::add_child(child, "block data",
                                                           "block data");
 	    	out.write((const char*)m_block_data.data(), 
@@ -415,6 +1013,8 @@ public: // constructors
       uint32_t frequ32 = m_freq_data.size();
       written_bytes += sdsl::write_member(docidu32,out,child,"docid u32s");
       written_bytes += sdsl::write_member(frequ32,out,child,"freq u32s");
+      // align the payload so a mapped list can be decoded in place
+      written_bytes += write_padding(out);
 
     	auto* idchild = sdsl::structure_tree::add_child(child, "id data",
                                                       "delta compressed");
@@ -435,16 +1035,33 @@ public: // constructors
       //Write blockmax data
       auto *bm_c = sdsl::structure_tree::add_child(child, "blockmax", 
                                                                     "blockmax");
+      size_type bm_written_bytes = sdsl::write_member(m_block_max_bits,
+                                  out, bm_c, "block max bits");
+      const char* bm_data = (const char*)m_block_maximums.data();
+      size_t num_block_max_scores = m_block_maximums.size();
+      size_t bm_width = sizeof(float);
+      if (m_block_max_bits != 0) {
+        bm_written_bytes += sdsl::write_member(m_block_max_scale, out, bm_c,
+                                               "block max scale");
+        if (m_block_max_bits == 8) {
+          bm_data = (const char*)m_block_maximums_u8.data();
+          num_block_max_scores = m_block_maximums_u8.size();
+          bm_width = sizeof(uint8_t);
+        } else {
+          bm_data = (const char*)m_block_maximums_u16.data();
+          num_block_max_scores = m_block_maximums_u16.size();
+          bm_width = sizeof(uint16_t);
+        }
+      }
       auto *bmm_c = sdsl::structure_tree::add_child(bm_c, "block maximums",
-                                   "double");
-      size_type bm_written_bytes = sdsl::write_member(m_block_maximums.size(), 
+                                   "quanta");
+      bm_written_bytes += sdsl::write_member(num_block_max_scores,
                                   out, bm_c, "num max_scores");
 
-      out.write((const char *)m_block_maximums.data(), 
-                                      m_block_maximums.size() * sizeof(double));
-      bm_written_bytes += m_block_maximums.size() * sizeof(double);
+      out.write(bm_data, num_block_max_scores * bm_width);
+      bm_written_bytes += num_block_max_scores * bm_width;
       sdsl::structure_tree::add_size(bmm_c, 
-                                   m_block_maximums.size() * sizeof(double));
+                                   num_block_max_scores * bm_width);
       sdsl::structure_tree::add_size(bm_c, bm_written_bytes);
       written_bytes += bm_written_bytes; 
       
@@ -458,20 +1075,29 @@ public: // constructors
 
 	  void load(std::istream& in) {
 		  read_member(m_size,in);
-		  if (m_size <= t_block_size) { // only one block
+		  read_member(m_codec,in);
+		  uint8_t variable_blocks;
+		  read_member(variable_blocks,in);
+		  uint64_t num_blocks = m_size / t_block_size;
+		  if (m_size % t_block_size != 0) num_blocks++;
+		  if (variable_blocks) {
+			  read_member(num_blocks,in);
+			  m_block_starts.resize(num_blocks+1);
+			  in.read((char*)m_block_starts.data(),(num_blocks+1)*sizeof(uint32_t));
+		  } else {
+			  m_block_starts = std::vector<uint32_t>();
+		  }
+		  if (!variable_blocks && m_size <= t_block_size) { // only one block
 			  uint32_t max_block_id;
-			  uint32_t id_bytes_used;
-			  uint32_t freq_bytes_used;
+			  block_data single;
 			  read_member(max_block_id,in);
-			  read_member(id_bytes_used,in);
-			  read_member(freq_bytes_used,in);
-			  m_block_data.resize(1);
-			  m_block_data[0].max_block_id = max_block_id;
-			  m_block_data[0].id_bytes = id_bytes_used;
-			  m_block_data[0].freq_bytes = freq_bytes_used;
+			  read_member(single.id_bytes,in);
+			  read_member(single.freq_bytes,in);
+			  m_block_reps = std::vector<uint32_t>(1, max_block_id);
+			  m_block_data = std::vector<block_data>(1, single);
 		  } else {
-			  uint64_t num_blocks = m_size / t_block_size;
-			  if (m_size % t_block_size != 0) num_blocks++;
+			  m_block_reps.resize(num_blocks);
+			  in.read((char*)m_block_reps.data(),num_blocks*sizeof(uint32_t));
 			  m_block_data.resize(num_blocks);
 			  in.read((char*)m_block_data.data(),num_blocks*sizeof(block_data));
 		  }
@@ -483,16 +1109,91 @@ public: // constructors
       read_member(frequ32,in);
       m_docid_data.resize(docidu32);
       m_freq_data.resize(frequ32);
+      skip_padding(in);
       in.read((char*)m_docid_data.data(),docidu32*sizeof(uint32_t));
       in.read((char*)m_freq_data.data(),frequ32*sizeof(uint32_t));
+      read_member(m_block_max_bits, in);
+      if (m_block_max_bits != 0) {
+        read_member(m_block_max_scale, in);
+      }
       size_t num_block_max_scores;
       read_member(num_block_max_scores, in);
-      m_block_maximums.resize(num_block_max_scores);
-      in.read((char *)m_block_maximums.data(), 
-                                         num_block_max_scores * sizeof(double));
+      if (m_block_max_bits == 8) {
+        m_block_maximums_u8.resize(num_block_max_scores);
+        in.read((char *)m_block_maximums_u8.data(), num_block_max_scores);
+      } else if (m_block_max_bits == 16) {
+        m_block_maximums_u16.resize(num_block_max_scores);
+        in.read((char *)m_block_maximums_u16.data(),
+                                       num_block_max_scores * sizeof(uint16_t));
+      } else {
+        m_block_maximums.resize(num_block_max_scores);
+        in.read((char *)m_block_maximums.data(), 
+                                         num_block_max_scores * sizeof(float));
+      }
 
       read_member(m_list_maximum,in);
 	}
+
+	  // Same layout as load(), but the arrays are views into the mapping.
+	  // Returns the position just after the list.
+	  const char* map(const char* ptr) {
+		  read_mapped(m_size,ptr);
+		  read_mapped(m_codec,ptr);
+		  uint8_t variable_blocks;
+		  read_mapped(variable_blocks,ptr);
+		  uint64_t num_blocks = m_size / t_block_size;
+		  if (m_size % t_block_size != 0) num_blocks++;
+		  if (variable_blocks) {
+			  read_mapped(num_blocks,ptr);
+			  m_block_starts.map((const uint32_t*)ptr, num_blocks+1);
+			  ptr += (num_blocks+1)*sizeof(uint32_t);
+		  } else {
+			  m_block_starts = std::vector<uint32_t>();
+		  }
+		  if (!variable_blocks && m_size <= t_block_size) { // only one block
+			  uint32_t max_block_id;
+			  block_data single;
+			  read_mapped(max_block_id,ptr);
+			  read_mapped(single.id_bytes,ptr);
+			  read_mapped(single.freq_bytes,ptr);
+			  m_block_reps = std::vector<uint32_t>(1, max_block_id);
+			  m_block_data = std::vector<block_data>(1, single);
+		  } else {
+			  m_block_reps.map((const uint32_t*)ptr, num_blocks);
+			  ptr += num_blocks*sizeof(uint32_t);
+			  m_block_data.map((const block_data*)ptr, num_blocks);
+			  ptr += num_blocks*sizeof(block_data);
+		  }
+
+      uint32_t docidu32;
+      uint32_t frequ32;
+      read_mapped(docidu32,ptr);
+      read_mapped(frequ32,ptr);
+      ptr = skip_padding(ptr);
+      m_docid_data.map((const uint32_t*)ptr, docidu32);
+      ptr += docidu32*sizeof(uint32_t);
+      m_freq_data.map((const uint32_t*)ptr, frequ32);
+      ptr += frequ32*sizeof(uint32_t);
+      read_mapped(m_block_max_bits,ptr);
+      if (m_block_max_bits != 0) {
+        read_mapped(m_block_max_scale,ptr);
+      }
+      size_t num_block_max_scores;
+      read_mapped(num_block_max_scores,ptr);
+      if (m_block_max_bits == 8) {
+        m_block_maximums_u8.map((const uint8_t*)ptr, num_block_max_scores);
+        ptr += num_block_max_scores;
+      } else if (m_block_max_bits == 16) {
+        m_block_maximums_u16.map((const uint16_t*)ptr, num_block_max_scores);
+        ptr += num_block_max_scores*sizeof(uint16_t);
+      } else {
+        m_block_maximums.map((const float*)ptr, num_block_max_scores);
+        ptr += num_block_max_scores*sizeof(float);
+      }
+
+      read_mapped(m_list_maximum,ptr);
+      return ptr;
+	}
 };
 
 
@@ -504,6 +1205,51 @@ plist_iterator<t_bs>::plist_iterator(const list_type& l,
   m_plist_ptr = &l;
 }
 
+// Copies the position of pi. A block pi decoded itself is read from the
+// copied buffers, not from the ones of pi.
+template<uint64_t t_bs>
+template<class t_other>
+void plist_iterator<t_bs>::assign(t_other&& pi)
+{
+  if (this == &pi)
+    return;
+  bool own_ids = pi.m_ids == pi.m_decoded_ids.data();
+  bool own_freqs = pi.m_freqs == pi.m_decoded_freqs.data();
+  m_cur_pos = pi.m_cur_pos;
+  m_cur_block_id = pi.m_cur_block_id;
+  m_last_accessed_block = pi.m_last_accessed_block;
+  m_last_accessed_id = pi.m_last_accessed_id;
+  m_cur_docid = pi.m_cur_docid;
+  m_last_freq_block = pi.m_last_freq_block;
+  m_plist_ptr = pi.m_plist_ptr;
+  m_decoded_ids = std::forward<t_other>(pi).m_decoded_ids;
+  m_decoded_freqs = std::forward<t_other>(pi).m_decoded_freqs;
+  m_ids = own_ids ? m_decoded_ids.data() : pi.m_ids;
+  m_ids_len = pi.m_ids_len;
+  m_freqs = own_freqs ? m_decoded_freqs.data() : pi.m_freqs;
+  m_block_cache = pi.m_block_cache;
+}
+
+// Moves a used iterator to another list. The decode buffers are kept, so
+// cursors reused across queries do not allocate.
+template<uint64_t t_bs>
+void plist_iterator<t_bs>::reset(const list_type& l, size_t pos)
+{
+  m_cur_pos = pos;
+  m_plist_ptr = &l;
+  // a cursor at the head is in the first block, so skip_to_id can search
+  // forward from it before anything is decoded
+  m_cur_block_id = pos == 0 ? 0 : std::numeric_limits<uint64_t>::max();
+  m_last_accessed_block = std::numeric_limits<uint64_t>::max()-1;
+  m_last_accessed_id = std::numeric_limits<uint64_t>::max()-1;
+  m_cur_docid = 0;
+  m_last_freq_block = std::numeric_limits<uint64_t>::max()-1;
+  m_block_cache = nullptr;
+  // no block holds more than t_bs postings
+  m_decoded_ids.reserve(t_bs);
+  m_decoded_freqs.reserve(t_bs);
+}
+
 template<uint64_t t_bs>
 plist_iterator<t_bs>& plist_iterator<t_bs>::operator++()
 {
@@ -556,30 +1302,55 @@ typename plist_iterator<t_bs>::value_type plist_iterator<t_bs>::freq() const
     std::cerr << "ERROR: plist iterator dereferenced at list end.\n";
     throw std::out_of_range("plist iterator dereferenced at list end");
   }
-  if (m_cur_pos == m_last_accessed_id) {
-    return m_cur_freq;
+  if (m_cur_pos != m_last_accessed_id) {
+    access_and_decode_cur_pos();
   }
-  access_and_decode_cur_pos();
-  return m_cur_freq;
+  // the decoded docid block holds the current position, m_cur_block_id
+  // may have been moved ahead by block_containing_id
+  if (m_last_freq_block != m_last_accessed_block) {
+    m_last_freq_block = m_last_accessed_block;
+    m_freqs = nullptr;
+    if (m_block_cache)
+      m_freqs = m_block_cache->freqs(*m_plist_ptr, m_last_accessed_block);
+    if (!m_freqs) {
+      m_plist_ptr->decompress_freqs(m_last_accessed_block,m_decoded_freqs);
+      m_freqs = m_decoded_freqs.data();
+    }
+  }
+  return m_freqs[m_cur_pos - m_plist_ptr->block_start(m_last_accessed_block)];
 }
 
 template<uint64_t t_bs>
 void plist_iterator<t_bs>::access_and_decode_cur_pos() const
 {
-  m_cur_block_id = m_cur_pos / t_bs;
+  m_cur_block_id = m_plist_ptr->block_of_pos(m_cur_pos, m_last_accessed_block);
   if (m_cur_block_id != m_last_accessed_block) {  // decompress block
-    m_last_accessed_block = m_cur_block_id;
-    m_plist_ptr->decompress_block(m_cur_block_id,m_decoded_ids,m_decoded_freqs);
+    decode_block_docids();
   }
-  size_t in_block_offset = m_cur_pos % t_bs;
-  m_cur_docid = m_decoded_ids[in_block_offset];
-  m_cur_freq = m_decoded_freqs[in_block_offset];
+  size_t in_block_offset = m_cur_pos - m_plist_ptr->block_start(m_cur_block_id);
+  m_cur_docid = m_ids[in_block_offset];
   m_last_accessed_id = m_cur_pos;
 }
 
+template<uint64_t t_bs>
+void plist_iterator<t_bs>::decode_block_docids() const
+{
+  m_last_accessed_block = m_cur_block_id;
+  m_ids_len = m_plist_ptr->postings_in_block(m_cur_block_id);
+  if (m_block_cache) {
+    m_ids = m_block_cache->docids(*m_plist_ptr, m_cur_block_id);
+    if (m_ids)
+      return;
+  }
+  m_plist_ptr->decompress_docids(m_cur_block_id,m_decoded_ids);
+  m_ids = m_decoded_ids.data();
+}
+
 template<uint64_t t_bs>
 const uint64_t plist_iterator<t_bs>::block_containing_id(const uint64_t id) {
   size_t block = m_plist_ptr->find_block_with_id(id, m_cur_block_id);
+  // past the last docid the last block still gives a valid bound
+  block = std::min<size_t>(block, m_plist_ptr->num_blocks() - 1);
   m_cur_block_id = block;
   return block;
 } 
@@ -592,9 +1363,10 @@ void plist_iterator<t_bs>::skip_to_block_with_id(const uint64_t id)
 
   // we now go to the first id in the new block!
   if (old_block != m_cur_block_id) {
-    m_cur_pos = m_cur_block_id*t_bs;
-    if (m_cur_pos > m_plist_ptr->size()) { // don't go past the end!
+    if (m_cur_block_id >= m_plist_ptr->num_blocks()) { // don't go past the end!
       m_cur_pos = m_plist_ptr->size();
+    } else {
+      m_cur_pos = m_plist_ptr->block_start(m_cur_block_id);
     }
   }
 }
@@ -613,22 +1385,23 @@ void plist_iterator<t_bs>::skip_to_id(const uint64_t id)
     return;
   }
   if (m_last_accessed_block != m_cur_block_id) {
-    m_last_accessed_block = m_cur_block_id;
-    m_plist_ptr->decompress_block(m_cur_block_id,m_decoded_ids,m_decoded_freqs);
-    auto block_itr = std::lower_bound(m_decoded_ids.begin(),
-                                      m_decoded_ids.end(),id);
-    m_cur_pos = (t_bs*m_cur_block_id) + 
-                std::distance(m_decoded_ids.begin(),block_itr);
+    decode_block_docids();
+    auto block_itr = simd_lower_bound(m_ids, m_ids + m_ids_len, id);
+    m_cur_pos = m_plist_ptr->block_start(m_cur_block_id) +
+                std::distance(m_ids,block_itr);
   } else {
-    size_t in_block_offset = m_cur_pos % t_bs;
-    auto block_itr = std::lower_bound(m_decoded_ids.begin()+in_block_offset,
-                                      m_decoded_ids.end(),id);
-    m_cur_pos = (t_bs*m_cur_block_id) + 
-                std::distance(m_decoded_ids.begin(),block_itr);
+    size_t in_block_offset = m_cur_pos - m_plist_ptr->block_start(m_cur_block_id);
+    if (in_block_offset >= m_ids_len) {
+      // moved past the block, so already past id
+      return;
+    }
+    auto block_itr = simd_lower_bound(m_ids+in_block_offset,
+                                      m_ids + m_ids_len, id);
+    m_cur_pos = m_plist_ptr->block_start(m_cur_block_id) +
+                std::distance(m_ids,block_itr);
   }
-  size_t inblock_offset = m_cur_pos % t_bs;
-  m_cur_docid = m_decoded_ids[inblock_offset];
-  m_cur_freq = m_decoded_freqs[inblock_offset];
+  size_t inblock_offset = m_cur_pos - m_plist_ptr->block_start(m_cur_block_id);
+  m_cur_docid = m_ids[inblock_offset];
   m_last_accessed_id = m_cur_pos;
 }
 
@@ -4,7 +4,7 @@
 #include "util.hpp"
 #include "generic_rank.hpp"
 
-struct rank_bm25 : public generic_rank {
+struct rank_bm25 final : public generic_rank {
 
   static constexpr double k1 = 0.9;
   static constexpr double b = 0.4;
@@ -13,7 +13,7 @@ struct rank_bm25 : public generic_rank {
   size_t num_terms;
   double avg_doc_len;
   double min_doc_len;
-  std::vector<uint64_t> doc_lengths;
+  std::vector<float> doc_norms; // K_d of every document
 
   static std::string name() {
     return "bm25";
@@ -29,21 +29,27 @@ struct rank_bm25 : public generic_rank {
   rank_bm25(std::vector<uint64_t> doc_len, 
           uint64_t terms, uint64_t numdocs) : num_docs(numdocs), 
           avg_doc_len((double)terms/(double)numdocs) {
-    doc_lengths = std::move(doc_len); //Takes ownership of the vector!
+    doc_norms.resize(doc_len.size());
+    for (size_t d = 0; d < doc_len.size(); d++) {
+      doc_norms[d] = k1*((1-b) + (b*(doc_len[d]/avg_doc_len)));
+    }
 
     std::cerr<<"num_docs = "<<num_docs<<std::endl;
     std::cerr<<"avg_doc_len = "<<avg_doc_len<<std::endl;
   }
 
-  uint64_t doc_length(const uint64_t doc_id) const {
-    return doc_lengths[doc_id];
+  // IDF of a term which occurs in f_t documents
+  double term_weight(const uint64_t f_t) const {
+    return std::max(epsilon_score,
+                    log((num_docs - (double)f_t + 0.5) / ((double)f_t+0.5)));
   }
-  
-  double calculate_docscore(const uint64_t f_dt,
-                            const uint64_t f_t, const double W_d) const {
-    double w_qt = std::max(epsilon_score, 
-                  log((num_docs - (double)f_t + 0.5) / ((double)f_t+0.5)));
-    double K_d = k1*((1-b) + (b*(W_d/avg_doc_len)));
+
+  double doc_norm(const uint64_t doc_id) const {
+    return doc_norms[doc_id];
+  }
+
+  double score(const uint64_t f_dt,
+               const double w_qt, const double K_d) const {
     double w_dt = ((k1+1)*(double)f_dt) / (K_d + f_dt);
     return w_dt*w_qt;
   }
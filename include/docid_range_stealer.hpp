@@ -0,0 +1,102 @@
+#ifndef DOCID_RANGE_STEALER_HPP
+#define DOCID_RANGE_STEALER_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// Splits the docid space of one query into equal chunks and deals them out
+// to the workers processing it. A worker takes chunks from the front of its
+// own range, once it runs dry it steals the back half of the largest range
+// left with another worker.
+class docid_range_stealer {
+private:
+  struct worker_range {
+    std::mutex mutex;
+    uint64_t next = 0; // first chunk not taken yet
+    uint64_t end = 0;  // one past the last chunk
+  };
+
+  uint64_t m_first_id;
+  uint64_t m_end_id;
+  uint64_t m_chunk_size;
+  std::vector<worker_range> m_ranges;
+
+  // Moves the back half of the largest remaining range to worker w
+  bool steal(const size_t w) {
+    while (true) {
+      size_t victim = m_ranges.size();
+      uint64_t most = 0;
+      for (size_t v = 0; v < m_ranges.size(); v++) {
+        if (v == w)
+          continue;
+        std::lock_guard<std::mutex> lock(m_ranges[v].mutex);
+        uint64_t left = m_ranges[v].end - m_ranges[v].next;
+        if (left > most) {
+          most = left;
+          victim = v;
+        }
+      }
+      if (victim == m_ranges.size())
+        return false;
+
+      uint64_t stolen_begin, stolen_end;
+      {
+        std::lock_guard<std::mutex> lock(m_ranges[victim].mutex);
+        uint64_t left = m_ranges[victim].end - m_ranges[victim].next;
+        if (left == 0)
+          continue; // drained since we looked, pick another victim
+        stolen_end = m_ranges[victim].end;
+        stolen_begin = stolen_end - (left + 1) / 2;
+        m_ranges[victim].end = stolen_begin;
+      }
+      std::lock_guard<std::mutex> lock(m_ranges[w].mutex);
+      m_ranges[w].next = stolen_begin;
+      m_ranges[w].end = stolen_end;
+      return true;
+    }
+  }
+
+public:
+  // Chunks the docids [first_id,end_id) for num_workers workers
+  docid_range_stealer(const uint64_t first_id, const uint64_t end_id,
+                      const size_t num_workers,
+                      const size_t chunks_per_worker) :
+      m_first_id(first_id), m_end_id(end_id), m_ranges(num_workers)
+  {
+    uint64_t num_chunks = num_workers * chunks_per_worker;
+    uint64_t span = end_id > first_id ? end_id - first_id : 0;
+    m_chunk_size = std::max<uint64_t>(1, (span + num_chunks - 1) / num_chunks);
+    num_chunks = (span + m_chunk_size - 1) / m_chunk_size;
+
+    uint64_t chunk = 0;
+    for (size_t w = 0; w < num_workers; w++) {
+      uint64_t share = num_chunks / num_workers +
+                       (w < num_chunks % num_workers ? 1 : 0);
+      m_ranges[w].next = chunk;
+      m_ranges[w].end = chunk + share;
+      chunk += share;
+    }
+  }
+
+  // Hands worker w its next docid range [begin,end). Returns false once
+  // every chunk has been taken.
+  bool next(const size_t w, uint64_t& begin, uint64_t& end) {
+    while (true) {
+      {
+        std::lock_guard<std::mutex> lock(m_ranges[w].mutex);
+        if (m_ranges[w].next < m_ranges[w].end) {
+          uint64_t chunk = m_ranges[w].next++;
+          begin = m_first_id + chunk * m_chunk_size;
+          end = std::min(m_end_id, begin + m_chunk_size);
+          return true;
+        }
+      }
+      if (!steal(w))
+        return false;
+    }
+  }
+};
+
+#endif // DOCID_RANGE_STEALER_HPP
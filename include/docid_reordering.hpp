@@ -0,0 +1,209 @@
+#ifndef DOCID_REORDERING_HPP
+#define DOCID_REORDERING_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Document orders build_index can renumber a collection by before its
+// lists are built. Documents sharing terms get close docids, so the docid
+// gaps compress better and the postings of a block score alike, which
+// tightens the block maximums. Each order returns the new docid of every
+// old docid.
+
+// Orders documents by name. When the names are URLs the pages of a site,
+// and of a directory in it, become neighbours (URL sort).
+inline std::vector<uint32_t>
+order_by_name(const std::vector<std::string>& names)
+{
+  std::vector<uint32_t> docs(names.size());
+  std::iota(docs.begin(), docs.end(), 0);
+  std::stable_sort(docs.begin(), docs.end(),
+    [&](const uint32_t a, const uint32_t b) {
+      return names[a] < names[b];
+    });
+  std::vector<uint32_t> new_ids(docs.size());
+  for (size_t i = 0; i < docs.size(); i++)
+    new_ids[docs[i]] = i;
+  return new_ids;
+}
+
+// Terms of every document, the input of the bisection. Terms are numbered
+// 0 to num_terms-1, the terms of document d are
+// terms[starts[d]] to terms[starts[d+1]-1].
+struct forward_index {
+  uint32_t num_terms = 0;
+  std::vector<uint64_t> starts;
+  std::vector<uint32_t> terms;
+};
+
+// Recursive graph bisection (Dhulipala et al., KDD 2016). The documents
+// are split in two halves, then documents are swapped between the halves
+// while that lowers the estimated cost of coding the docid gaps of both,
+// and each half is bisected again down to a few documents. Documents left
+// in the same leaf keep their old order. The top levels of the recursion
+// run the halves on separate threads.
+class recursive_graph_bisection {
+public:
+  static const size_t ITERATIONS = 20;
+  static const size_t LEAF_SIZE = 16;
+
+private:
+  // Term degrees of the two halves of a partition, per thread. They are
+  // cleared after every partition, so they are only sized once.
+  struct bisection_scratch {
+    std::vector<uint32_t> left_degrees;
+    std::vector<uint32_t> right_degrees;
+    std::vector<std::pair<float,uint32_t>> left_gains;
+    std::vector<std::pair<float,uint32_t>> right_gains;
+  };
+
+  const forward_index& m_fwd;
+  size_t m_parallel_depth = 0;
+  std::vector<float> m_log2; // log2 of small integers
+
+  float log2_of(const uint64_t x) const {
+    return x < m_log2.size() ? m_log2[x] : std::log2((float)x);
+  }
+
+  // Bits of a term with deg postings among n documents, the log of the
+  // average gap for each of them
+  float cost(const uint64_t deg, const uint64_t n) const {
+    return deg * (log2_of(n) - log2_of(deg + 1));
+  }
+
+  // Lower cost when a document with the term moves from the from half to
+  // the other one
+  float move_gain(const uint64_t from_deg, const uint64_t to_deg,
+                  const uint64_t from_n, const uint64_t to_n) const {
+    float before = cost(from_deg, from_n) + cost(to_deg, to_n);
+    float after = cost(from_deg - 1, from_n) + cost(to_deg + 1, to_n);
+    return before - after;
+  }
+
+  static bisection_scratch& thread_scratch() {
+    static thread_local bisection_scratch scratch;
+    return scratch;
+  }
+
+  void add_terms(const uint32_t doc, std::vector<uint32_t>& degrees,
+                 const int delta) const {
+    for (uint64_t i = m_fwd.starts[doc]; i < m_fwd.starts[doc+1]; i++)
+      degrees[m_fwd.terms[i]] += delta;
+  }
+
+  void clear_terms(const uint32_t doc, bisection_scratch& s) const {
+    for (uint64_t i = m_fwd.starts[doc]; i < m_fwd.starts[doc+1]; i++) {
+      s.left_degrees[m_fwd.terms[i]] = 0;
+      s.right_degrees[m_fwd.terms[i]] = 0;
+    }
+  }
+
+  // Gains of moving every document of one half, largest first
+  void compute_gains(const uint32_t* docs, const size_t n,
+                     const std::vector<uint32_t>& from_degrees,
+                     const std::vector<uint32_t>& to_degrees,
+                     const size_t from_n, const size_t to_n,
+                     std::vector<std::pair<float,uint32_t>>& gains) const {
+    gains.resize(n);
+    for (size_t i = 0; i < n; i++) {
+      uint32_t doc = docs[i];
+      float gain = 0;
+      for (uint64_t j = m_fwd.starts[doc]; j < m_fwd.starts[doc+1]; j++) {
+        uint32_t term = m_fwd.terms[j];
+        gain += move_gain(from_degrees[term], to_degrees[term], from_n, to_n);
+      }
+      gains[i] = {gain, doc};
+    }
+    std::sort(gains.begin(), gains.end(),
+      [](const std::pair<float,uint32_t>& a,
+         const std::pair<float,uint32_t>& b) {
+        return a.first > b.first;
+      });
+  }
+
+  void bisect(uint32_t* docs, const size_t n, const size_t depth) {
+    if (n <= LEAF_SIZE) {
+      std::sort(docs, docs + n);
+      return;
+    }
+    bisection_scratch& s = thread_scratch();
+    if (s.left_degrees.size() < m_fwd.num_terms) {
+      s.left_degrees.resize(m_fwd.num_terms);
+      s.right_degrees.resize(m_fwd.num_terms);
+    }
+    uint32_t* left = docs;
+    uint32_t* right = docs + n / 2;
+    const size_t left_n = n / 2, right_n = n - n / 2;
+    for (size_t i = 0; i < left_n; i++)
+      add_terms(left[i], s.left_degrees, 1);
+    for (size_t i = 0; i < right_n; i++)
+      add_terms(right[i], s.right_degrees, 1);
+
+    for (size_t iter = 0; iter < ITERATIONS; iter++) {
+      compute_gains(left, left_n, s.left_degrees, s.right_degrees,
+                    left_n, right_n, s.left_gains);
+      compute_gains(right, right_n, s.right_degrees, s.left_degrees,
+                    right_n, left_n, s.right_gains);
+      size_t swaps = 0;
+      for (size_t i = 0; i < left_n && i < right_n; i++) {
+        if (s.left_gains[i].first + s.right_gains[i].first <= 0)
+          break;
+        uint32_t to_right = s.left_gains[i].second;
+        uint32_t to_left = s.right_gains[i].second;
+        add_terms(to_right, s.left_degrees, -1);
+        add_terms(to_right, s.right_degrees, 1);
+        add_terms(to_left, s.right_degrees, -1);
+        add_terms(to_left, s.left_degrees, 1);
+        std::swap(s.left_gains[i].second, s.right_gains[i].second);
+        swaps++;
+      }
+      for (size_t i = 0; i < left_n; i++)
+        left[i] = s.left_gains[i].second;
+      for (size_t i = 0; i < right_n; i++)
+        right[i] = s.right_gains[i].second;
+      if (swaps == 0)
+        break;
+    }
+    for (size_t i = 0; i < n; i++)
+      clear_terms(docs[i], s);
+
+    if (depth < m_parallel_depth) {
+      std::thread left_half(&recursive_graph_bisection::bisect, this, left,
+                            left_n, depth + 1);
+      bisect(right, right_n, depth + 1);
+      left_half.join();
+    } else {
+      bisect(left, left_n, depth + 1);
+      bisect(right, right_n, depth + 1);
+    }
+  }
+
+public:
+  recursive_graph_bisection(const forward_index& fwd, const size_t threads)
+    : m_fwd(fwd) {
+    while (((size_t)1 << m_parallel_depth) < threads)
+      m_parallel_depth++;
+    m_log2.resize(std::min<size_t>(fwd.starts.size() + 1, 1 << 16));
+    for (size_t i = 1; i < m_log2.size(); i++)
+      m_log2[i] = std::log2((float)i);
+  }
+
+  std::vector<uint32_t> order() {
+    size_t num_docs = m_fwd.starts.size() - 1;
+    std::vector<uint32_t> docs(num_docs);
+    std::iota(docs.begin(), docs.end(), 0);
+    bisect(docs.data(), num_docs, 0);
+    std::vector<uint32_t> new_ids(num_docs);
+    for (size_t i = 0; i < num_docs; i++)
+      new_ids[docs[i]] = i;
+    return new_ids;
+  }
+};
+
+#endif // DOCID_REORDERING_HPP
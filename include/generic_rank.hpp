@@ -3,12 +3,17 @@
 
 #include "util.hpp"
 
+// A score is split into a per term weight, a per document normaliser and
+// the part that depends on f_dt, so the first two are computed once per
+// query term and at load time respectively
 struct generic_rank {
-  virtual uint64_t doc_length(const uint64_t docid) const = 0;
-	
-  virtual double calculate_docscore(const uint64_t f_dt, 
-                                    const uint64_t f_t, 
-                                    const double w_d) const = 0;
+  virtual double term_weight(const uint64_t f_t) const = 0;
+
+  virtual double doc_norm(const uint64_t docid) const = 0;
+
+  virtual double score(const uint64_t f_dt,
+                       const double w_qt,
+                       const double norm_d) const = 0;
   
   virtual ~generic_rank() {} // Avoid memory leaks: need virtual destruction
 };
@@ -4,7 +4,7 @@
 #include "util.hpp"
 #include "generic_rank.hpp"
 
-struct rank_impact : public generic_rank {
+struct rank_impact final : public generic_rank {
 
 	rank_impact(){}
 	rank_impact& operator=(const rank_impact&) = default;
@@ -14,13 +14,17 @@ struct rank_impact : public generic_rank {
 	static std::string name() {
 		return "impact";
 	}
-	uint64_t doc_length(const uint64_t) const {
+	double term_weight(const uint64_t) const {
+		return 1;
+	}
+	double doc_norm(const uint64_t) const {
 		return 0;
 	}
 	double calc_doc_weight(double ) const {
 		return 0;
 	}
-	double calculate_docscore(const uint64_t f_dt, const uint64_t, const double) const {
+	// the impact is the score
+	double score(const uint64_t f_dt, const double, const double) const {
 		return f_dt;
 	}
 };
@@ -0,0 +1,179 @@
+#ifndef IMPACT_POSTINGS_LIST_HPP
+#define IMPACT_POSTINGS_LIST_HPP
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+#include "util.hpp"
+#include "memutil.h"
+#include "compress_qmx.h"
+#include "mapped_file.hpp"
+
+#include "sdsl/int_vector.hpp"
+
+// Impact ordered postings list of a SAAT index. The postings of one
+// impact form a segment, segments are stored by decreasing impact and the
+// docids of a segment are ascending d-gaps compressed with QMX.
+class impact_postings_list {
+  public: // types
+    using size_type = sdsl::int_vector<>::size_type;
+    using data_type = std::vector<uint32_t, FastPForLib::cacheallocator>;
+    using store_type = mappable_vector<uint32_t, FastPForLib::cacheallocator>;
+    struct segment {
+      uint32_t impact = 0;
+      uint32_t count = 0;    // postings in the segment
+      uint32_t offset = 0;   // first word of its docids in m_docid_data
+      uint32_t bytes = 0;    // compressed size
+    };
+  public: // actual data
+    uint64_t m_size = 0;
+    mappable_vector<segment> m_segments;
+    store_type m_docid_data;
+  public:
+    impact_postings_list() = default;
+    impact_postings_list(const impact_postings_list& pl) = default;
+    impact_postings_list(impact_postings_list&& pl) = default;
+    impact_postings_list& operator=(const impact_postings_list& pl) = default;
+    impact_postings_list& operator=(impact_postings_list&& pl) = default;
+
+    impact_postings_list(std::istream& in) {
+      load(in);
+    }
+
+    // View over a list serialized at ptr inside a mapped index file
+    impact_postings_list(const char* ptr) {
+      map(ptr);
+    }
+
+    // Takes (docid, impact) pairs, the docids of one impact ascending
+    impact_postings_list(std::vector<std::pair<uint64_t,uint64_t>>& postings) {
+      m_size = postings.size();
+      std::stable_sort(postings.begin(), postings.end(),
+        [](const std::pair<uint64_t,uint64_t>& a,
+           const std::pair<uint64_t,uint64_t>& b) {
+          return a.second > b.second;
+        });
+
+      static thread_local ANT_compress_qmx qmx;
+      std::vector<segment> segments;
+      data_type docid_data(2 * postings.size() + 1024);
+      std::vector<uint32_t> gaps;
+      uint64_t offset = 0;
+      size_t i = 0;
+      while (i < postings.size()) {
+        segment seg;
+        seg.impact = postings[i].second;
+        uint32_t prev = 0;
+        gaps.clear();
+        for (; i < postings.size() && postings[i].second == seg.impact; i++) {
+          gaps.push_back(postings[i].first - prev);
+          prev = postings[i].first;
+        }
+        seg.count = gaps.size();
+        seg.offset = offset;
+        if (offset + 2 * gaps.size() + 1024 > docid_data.size()) {
+          docid_data.resize(offset + 2 * gaps.size() + 1024);
+        }
+        uint64_t bytes_used = 0;
+        qmx.encodeArray(gaps.data(), gaps.size(), &docid_data[offset],
+                        &bytes_used);
+        seg.bytes = bytes_used;
+        offset += (bytes_used + sizeof(uint32_t) - 1) / sizeof(uint32_t);
+        // keep every segment 16 byte aligned for the SIMD decoder
+        offset += (4 - offset % 4) % 4;
+        segments.push_back(seg);
+      }
+      docid_data.resize(offset);
+      docid_data.shrink_to_fit();
+      m_segments = std::move(segments);
+      m_docid_data = std::move(docid_data);
+    }
+
+    size_type size() const {
+      return m_size;
+    }
+
+    size_type num_segments() const {
+      return m_segments.size();
+    }
+
+    const segment& segment_at(const size_t s) const {
+      return m_segments[s];
+    }
+
+    uint32_t list_max_score() const {
+      return m_segments.size() ? m_segments[0].impact : 0;
+    }
+
+    // Decodes the docids of segment s into ids
+    void decompress_segment(const size_t s, data_type& ids) const {
+      static ANT_compress_qmx qmx;
+      const segment& seg = m_segments[s];
+      // QMX decodes whole selectors and may write past seg.count
+      if (ids.size() < seg.count + 256) {
+        ids.resize(seg.count + 256);
+      }
+      qmx.decodeArray(m_docid_data.data() + seg.offset, seg.bytes, ids.data(),
+                      seg.count);
+      uint32_t docid = 0;
+      for (size_t i = 0; i < seg.count; i++) {
+        docid += ids[i];
+        ids[i] = docid;
+      }
+    }
+
+    auto serialize(std::ostream& out, sdsl::structure_tree_node* v = nullptr,
+                   std::string name = "") const -> size_type
+    {
+      auto* child = sdsl::structure_tree::add_child(v, name,
+                                                    "impact postings list");
+      size_type written_bytes = 0;
+      written_bytes += sdsl::write_member(m_size, out, child, "size");
+      uint64_t num_segments = m_segments.size();
+      written_bytes += sdsl::write_member(num_segments, out, child,
+                                          "num segments");
+      out.write((const char*)m_segments.data(), num_segments*sizeof(segment));
+      written_bytes += num_segments*sizeof(segment);
+      uint64_t docid_words = m_docid_data.size();
+      written_bytes += sdsl::write_member(docid_words, out, child,
+                                          "docid words");
+      written_bytes += write_padding(out);
+      out.write((const char*)m_docid_data.data(),
+                docid_words*sizeof(uint32_t));
+      written_bytes += docid_words*sizeof(uint32_t);
+      sdsl::structure_tree::add_size(child, written_bytes);
+      return written_bytes;
+    }
+
+    void load(std::istream& in) {
+      sdsl::read_member(m_size, in);
+      uint64_t num_segments;
+      sdsl::read_member(num_segments, in);
+      m_segments.resize(num_segments);
+      in.read((char*)m_segments.data(), num_segments*sizeof(segment));
+      uint64_t docid_words;
+      sdsl::read_member(docid_words, in);
+      skip_padding(in);
+      m_docid_data.resize(docid_words);
+      in.read((char*)m_docid_data.data(), docid_words*sizeof(uint32_t));
+    }
+
+    // Same layout as load(), but the arrays are views into the mapping.
+    // Returns the position just after the list.
+    const char* map(const char* ptr) {
+      read_mapped(m_size, ptr);
+      uint64_t num_segments;
+      read_mapped(num_segments, ptr);
+      m_segments.map((const segment*)ptr, num_segments);
+      ptr += num_segments*sizeof(segment);
+      uint64_t docid_words;
+      read_mapped(docid_words, ptr);
+      ptr = skip_padding(ptr);
+      m_docid_data.map((const uint32_t*)ptr, docid_words);
+      ptr += docid_words*sizeof(uint32_t);
+      return ptr;
+    }
+};
+
+#endif // IMPACT_POSTINGS_LIST_HPP
@@ -0,0 +1,397 @@
+#ifndef INDEX_METADATA_HPP
+#define INDEX_METADATA_HPP
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "mapped_file.hpp"
+
+// build_index writes the collection metadata twice: as the text files
+// tools read and as these binary files, which search_index maps instead of
+// parsing. The text files are only read when the binary ones are missing.
+const std::string DICT_FILENAME = "dict.txt";
+const std::string DICT_BIN_FILENAME = "dict.bin";
+const std::string DOC_LENS_FILENAME = "doc_lens.txt";
+const std::string DOC_LENS_BIN_FILENAME = "doc_lens.bin";
+const std::string DOC_NAMES_FILENAME = "doc_names.txt";
+const std::string DOC_NAMES_BIN_FILENAME = "doc_names.bin";
+
+// util.hpp defines globals, so it cannot be included by the sources that
+// only need the metadata
+inline bool metadata_file_exists(const std::string& file_name) {
+  struct stat sb;
+  return stat(file_name.c_str(), &sb) == 0;
+}
+
+template<class T>
+inline void write_pod(std::ostream& out, const T& t) {
+  out.write((const char*)&t, sizeof(T));
+}
+
+// Strings front coded in buckets of BUCKET_SIZE. The first string of a
+// bucket is stored whole, the others as the length of the prefix shared
+// with the string before and the remaining suffix. Neighbouring terms of
+// a sorted dictionary and consecutive URLs or TREC docnos share most of
+// their bytes.
+class front_coded_strings {
+public:
+  static const size_t BUCKET_SIZE = 16;
+
+private:
+  uint64_t m_size = 0;
+  mappable_vector<uint64_t> m_bucket_offsets; // bucket starts in m_data
+  mappable_vector<char> m_data;
+
+  static void write_vbyte(std::vector<char>& out, uint64_t x) {
+    while (x >= 128) {
+      out.push_back((char)(x & 127) | (char)128);
+      x >>= 7;
+    }
+    out.push_back((char)x);
+  }
+
+  static uint64_t read_vbyte(const char*& ptr) {
+    uint64_t x = 0;
+    for (int shift = 0; ; shift += 7) {
+      uint8_t byte = *ptr++;
+      x |= (uint64_t)(byte & 127) << shift;
+      if (byte < 128)
+        return x;
+    }
+  }
+
+  // Compares the bytes at ptr with str like std::string::compare
+  static int compare(const char* ptr, const size_t len,
+                     const std::string& str) {
+    int cmp = std::memcmp(ptr, str.data(), std::min(len, str.size()));
+    if (cmp != 0)
+      return cmp;
+    return len < str.size() ? -1 : (len > str.size() ? 1 : 0);
+  }
+
+public:
+  front_coded_strings() = default;
+
+  explicit front_coded_strings(const std::vector<std::string>& strings) {
+    m_size = strings.size();
+    std::vector<uint64_t> offsets;
+    std::vector<char> data;
+    for (size_t i = 0; i < strings.size(); i++) {
+      const std::string& str = strings[i];
+      if (i % BUCKET_SIZE == 0) {
+        offsets.push_back(data.size());
+        write_vbyte(data, str.size());
+        data.insert(data.end(), str.begin(), str.end());
+        continue;
+      }
+      const std::string& prev = strings[i-1];
+      size_t lcp = 0;
+      while (lcp < str.size() && lcp < prev.size() && str[lcp] == prev[lcp])
+        lcp++;
+      write_vbyte(data, lcp);
+      write_vbyte(data, str.size() - lcp);
+      data.insert(data.end(), str.begin() + lcp, str.end());
+    }
+    offsets.push_back(data.size());
+    m_bucket_offsets = mappable_vector<uint64_t>(std::move(offsets));
+    m_data = mappable_vector<char>(std::move(data));
+  }
+
+  size_t size() const { return m_size; }
+
+  std::string operator[](const size_t i) const {
+    const char* ptr = m_data.data() + m_bucket_offsets[i / BUCKET_SIZE];
+    std::string str;
+    uint64_t len = read_vbyte(ptr);
+    str.assign(ptr, len);
+    ptr += len;
+    for (size_t j = 0; j < i % BUCKET_SIZE; j++) {
+      uint64_t lcp = read_vbyte(ptr);
+      len = read_vbyte(ptr);
+      str.resize(lcp);
+      str.append(ptr, len);
+      ptr += len;
+    }
+    return str;
+  }
+
+  // Position of str in strings stored in sorted order, size() if it is
+  // not one of them. Bisects the bucket heads, then scans one bucket.
+  size_t find_sorted(const std::string& str) const {
+    size_t num_buckets = m_bucket_offsets.size() - 1;
+    if (m_size == 0)
+      return m_size;
+    // last bucket whose first string is <= str
+    size_t lo = 0, hi = num_buckets;
+    while (hi - lo > 1) {
+      size_t mid = lo + (hi - lo) / 2;
+      const char* ptr = m_data.data() + m_bucket_offsets[mid];
+      uint64_t len = read_vbyte(ptr);
+      if (compare(ptr, len, str) <= 0) {
+        lo = mid;
+      } else {
+        hi = mid;
+      }
+    }
+    size_t first = lo * BUCKET_SIZE;
+    size_t last = std::min<size_t>(first + BUCKET_SIZE, m_size);
+    const char* ptr = m_data.data() + m_bucket_offsets[lo];
+    std::string cur;
+    uint64_t len = read_vbyte(ptr);
+    cur.assign(ptr, len);
+    ptr += len;
+    for (size_t i = first; i < last; i++) {
+      if (i > first) {
+        uint64_t lcp = read_vbyte(ptr);
+        len = read_vbyte(ptr);
+        cur.resize(lcp);
+        cur.append(ptr, len);
+        ptr += len;
+      }
+      int cmp = cur.compare(str);
+      if (cmp == 0)
+        return i;
+      if (cmp > 0)
+        break;
+    }
+    return m_size;
+  }
+
+  void serialize(std::ostream& out) const {
+    write_pod(out, m_size);
+    uint64_t num_offsets = m_bucket_offsets.size();
+    write_pod(out, num_offsets);
+    write_padding(out);
+    out.write((const char*)m_bucket_offsets.data(),
+              num_offsets * sizeof(uint64_t));
+    uint64_t data_bytes = m_data.size();
+    write_pod(out, data_bytes);
+    out.write(m_data.data(), data_bytes);
+  }
+
+  // Views the strings serialized at ptr, returns the position after them
+  const char* map(const char* ptr) {
+    read_mapped(m_size, ptr);
+    uint64_t num_offsets;
+    read_mapped(num_offsets, ptr);
+    ptr = skip_padding(ptr);
+    m_bucket_offsets.map((const uint64_t*)ptr, num_offsets);
+    ptr += num_offsets * sizeof(uint64_t);
+    uint64_t data_bytes;
+    read_mapped(data_bytes, ptr);
+    m_data.map(ptr, data_bytes);
+    return ptr + data_bytes;
+  }
+};
+
+// Term to id mapping of a collection. The terms are front coded in sorted
+// order and found by bisection; the ids of the sorted terms and the sorted
+// position of every id give both directions without hashing.
+class term_dictionary {
+public:
+  static const uint64_t NO_TERM = std::numeric_limits<uint64_t>::max();
+
+private:
+  front_coded_strings m_terms;
+  mappable_vector<uint64_t> m_ids;       // id of each sorted term
+  mappable_vector<uint64_t> m_positions; // sorted position of each id
+  mapped_file m_file; // only used when the dictionary is mapped
+
+public:
+  term_dictionary() = default;
+  term_dictionary(term_dictionary&&) = default;
+  term_dictionary& operator=(term_dictionary&&) = default;
+
+  explicit term_dictionary(std::vector<std::pair<std::string,uint64_t>> terms) {
+    std::stable_sort(terms.begin(), terms.end(),
+      [](const std::pair<std::string,uint64_t>& a,
+         const std::pair<std::string,uint64_t>& b) {
+        return a.first < b.first;
+      });
+    std::vector<std::string> sorted_terms;
+    std::vector<uint64_t> ids;
+    for (const auto& term : terms) {
+      // a term listed twice keeps its last id, as the dict.txt loader
+      // always did
+      if (!sorted_terms.empty() && sorted_terms.back() == term.first) {
+        ids.back() = term.second;
+        continue;
+      }
+      sorted_terms.push_back(term.first);
+      ids.push_back(term.second);
+    }
+    uint64_t max_id = 0;
+    for (const auto id : ids)
+      max_id = std::max(max_id, id);
+    std::vector<uint64_t> positions(ids.empty() ? 0 : max_id + 1);
+    std::fill(positions.begin(), positions.end(), (uint64_t)NO_TERM);
+    for (size_t i = 0; i < ids.size(); i++)
+      positions[ids[i]] = i;
+    m_terms = front_coded_strings(sorted_terms);
+    m_ids = mappable_vector<uint64_t>(std::move(ids));
+    m_positions = mappable_vector<uint64_t>(std::move(positions));
+  }
+
+  size_t size() const { return m_terms.size(); }
+
+  bool find(const std::string& term, uint64_t& id) const {
+    size_t pos = m_terms.find_sorted(term);
+    if (pos == m_terms.size())
+      return false;
+    id = m_ids[pos];
+    return true;
+  }
+
+  // The term of id, empty if no term has it
+  std::string term(const uint64_t id) const {
+    if (id >= m_positions.size() || m_positions[id] == NO_TERM)
+      return "";
+    return m_terms[m_positions[id]];
+  }
+
+  void serialize(std::ostream& out) const {
+    m_terms.serialize(out);
+    uint64_t num_ids = m_ids.size();
+    write_pod(out, num_ids);
+    write_padding(out);
+    out.write((const char*)m_ids.data(), num_ids * sizeof(uint64_t));
+    uint64_t num_positions = m_positions.size();
+    write_pod(out, num_positions);
+    write_padding(out);
+    out.write((const char*)m_positions.data(),
+              num_positions * sizeof(uint64_t));
+  }
+
+  void map(const std::string& file) {
+    m_file = mapped_file(file);
+    const char* ptr = m_terms.map(m_file.data());
+    uint64_t num_ids;
+    read_mapped(num_ids, ptr);
+    ptr = skip_padding(ptr);
+    m_ids.map((const uint64_t*)ptr, num_ids);
+    ptr += num_ids * sizeof(uint64_t);
+    uint64_t num_positions;
+    read_mapped(num_positions, ptr);
+    ptr = skip_padding(ptr);
+    m_positions.map((const uint64_t*)ptr, num_positions);
+  }
+
+  // Maps dict.bin, or parses dict.txt when there is none
+  static term_dictionary load(const std::string& collection_dir) {
+    std::string bin_file = collection_dir + "/" + DICT_BIN_FILENAME;
+    if (metadata_file_exists(bin_file)) {
+      term_dictionary dict;
+      dict.map(bin_file);
+      return dict;
+    }
+    return load_text(collection_dir);
+  }
+
+  // Parses the "term id ..." lines of dict.txt
+  static term_dictionary load_text(const std::string& collection_dir) {
+    auto dict_file = collection_dir + "/" + DICT_FILENAME;
+    std::ifstream dfs(dict_file);
+    if(!dfs.is_open()) {
+      std::cerr << "cannot load dictionary file.";
+      exit(EXIT_FAILURE);
+    }
+    std::vector<std::pair<std::string,uint64_t>> terms;
+    std::string term_mapping;
+    while( std::getline(dfs,term_mapping) ) {
+      auto sep_pos = term_mapping.find(' ');
+      auto term = term_mapping.substr(0,sep_pos);
+      auto idstr = term_mapping.substr(sep_pos+1);
+      terms.emplace_back(term, std::stoull(idstr));
+    }
+    return term_dictionary(std::move(terms));
+  }
+};
+
+// Document names by docid, mapped from doc_names.bin or read from the
+// lines of doc_names.txt
+class document_names {
+private:
+  front_coded_strings m_names;
+  mapped_file m_file;
+
+public:
+  document_names() = default;
+  document_names(document_names&&) = default;
+  document_names& operator=(document_names&&) = default;
+
+  explicit document_names(const std::vector<std::string>& names)
+    : m_names(names) {}
+
+  size_t size() const { return m_names.size(); }
+
+  // The name of doc_id, empty past the last document
+  std::string operator[](const uint64_t doc_id) const {
+    return doc_id < m_names.size() ? m_names[doc_id] : "";
+  }
+
+  void serialize(std::ostream& out) const {
+    m_names.serialize(out);
+  }
+
+  static document_names load(const std::string& collection_dir) {
+    document_names names;
+    std::string bin_file = collection_dir + "/" + DOC_NAMES_BIN_FILENAME;
+    if (metadata_file_exists(bin_file)) {
+      names.m_file = mapped_file(bin_file);
+      names.m_names.map(names.m_file.data());
+      return names;
+    }
+    std::vector<std::string> lines;
+    std::ifstream dfs(collection_dir + "/" + DOC_NAMES_FILENAME);
+    for (std::string line; std::getline(dfs, line);)
+      lines.push_back(line);
+    return document_names(lines);
+  }
+};
+
+// Document lengths as a count followed by a packed uint32 array
+inline void write_doc_lengths(std::ostream& out,
+                              const std::vector<uint64_t>& doc_lens) {
+  uint64_t num_docs = doc_lens.size();
+  write_pod(out, num_docs);
+  for (auto len : doc_lens) {
+    uint32_t packed = len;
+    write_pod(out, packed);
+  }
+}
+
+// Lengths of the documents from doc_lens.bin, or parsed from doc_lens.txt
+inline std::vector<uint64_t> load_doc_lengths(const std::string& collection_dir) {
+  std::vector<uint64_t> doc_lens;
+  std::string bin_file = collection_dir + "/" + DOC_LENS_BIN_FILENAME;
+  if (metadata_file_exists(bin_file)) {
+    mapped_file file(bin_file);
+    const char* ptr = file.data();
+    uint64_t num_docs;
+    read_mapped(num_docs, ptr);
+    doc_lens.resize(num_docs);
+    for (size_t i = 0; i < num_docs; i++) {
+      uint32_t len;
+      read_mapped(len, ptr);
+      doc_lens[i] = len;
+    }
+    return doc_lens;
+  }
+  std::string text_file = collection_dir + "/" + DOC_LENS_FILENAME;
+  std::ifstream doclen_file(text_file);
+  if(!doclen_file.is_open()){
+    std::cerr << "Couldn't open: " << text_file << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  for (uint64_t len; doclen_file >> len;)
+    doc_lens.push_back(len);
+  return doc_lens;
+}
+
+#endif // INDEX_METADATA_HPP
@@ -0,0 +1,116 @@
+#ifndef INTRA_QUERY_POOL_HPP
+#define INTRA_QUERY_POOL_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Threads kept for the lifetime of an index to help queries split over
+// docid ranges. A query posts a job of worker slots; pool threads and the
+// posting thread claim slots until none is left, so a query never waits
+// for a pool thread busy with another query, and the thread local cursors
+// and heaps of the pool threads are reused across queries.
+class intra_query_pool {
+private:
+  struct job {
+    const std::function<void(size_t)>* fn;
+    size_t num_slots;
+    size_t next_slot = 0;
+    size_t done = 0;
+    std::condition_variable finished;
+  };
+
+  std::mutex m_mutex;
+  std::condition_variable m_work_ready;
+  std::deque<job*> m_jobs; // jobs with unclaimed slots
+  bool m_stopping = false;
+  std::vector<std::thread> m_threads;
+
+  // Next unclaimed slot of j, num_slots once all are taken. Called with
+  // the mutex held, retires the job when its last slot goes.
+  size_t claim(job& j) {
+    size_t slot = j.next_slot < j.num_slots ? j.next_slot++ : j.num_slots;
+    if (j.next_slot == j.num_slots) {
+      for (auto itr = m_jobs.begin(); itr != m_jobs.end(); ++itr) {
+        if (*itr == &j) {
+          m_jobs.erase(itr);
+          break;
+        }
+      }
+    }
+    return slot;
+  }
+
+  void run_slot(job& j, const size_t slot) {
+    (*j.fn)(slot);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (++j.done == j.num_slots)
+      j.finished.notify_all();
+  }
+
+  void work() {
+    while (true) {
+      job* j;
+      size_t slot;
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_work_ready.wait(lock, [&] {
+          return m_stopping || !m_jobs.empty();
+        });
+        if (m_jobs.empty())
+          return;
+        j = m_jobs.front();
+        slot = claim(*j);
+      }
+      run_slot(*j, slot);
+    }
+  }
+
+public:
+  explicit intra_query_pool(const size_t threads) {
+    for (size_t i = 0; i < threads; i++)
+      m_threads.emplace_back(&intra_query_pool::work, this);
+  }
+  intra_query_pool(const intra_query_pool&) = delete;
+  intra_query_pool& operator=(const intra_query_pool&) = delete;
+
+  ~intra_query_pool() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stopping = true;
+    }
+    m_work_ready.notify_all();
+    for (auto& thread : m_threads)
+      thread.join();
+  }
+
+  // Runs fn(0) to fn(slots-1) on the calling thread and the pool, returns
+  // once all have finished
+  void run(const size_t slots, const std::function<void(size_t)>& fn) {
+    job j;
+    j.fn = &fn;
+    j.num_slots = slots;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_jobs.push_back(&j);
+    }
+    m_work_ready.notify_all();
+    while (true) {
+      size_t slot;
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        slot = claim(j);
+      }
+      if (slot == slots)
+        break;
+      run_slot(j, slot);
+    }
+    std::unique_lock<std::mutex> lock(m_mutex);
+    j.finished.wait(lock, [&] { return j.done == j.num_slots; });
+  }
+};
+
+#endif // INTRA_QUERY_POOL_HPP
@@ -2,6 +2,8 @@
 #define INVIDX_HPP
 
 #include <unordered_map>
+#include <atomic>
+#include <thread>
 #include <chrono>
 #include <iostream>
 #include <string>
@@ -9,16 +11,22 @@
 #include "sdsl/config.hpp"
 #include "sdsl/int_vector.hpp"
 #include "block_postings_list.hpp"
+#include "mapped_file.hpp"
 #include "util.hpp"
 #include "generic_rank.hpp"
 #include "bm25.hpp"
 #include "impact.hpp"
 #include "lowerbound_threshold.hpp"
+#include "docid_range_stealer.hpp"
+#include "intra_query_pool.hpp"
+#include "topk_queue.hpp"
 
 using namespace sdsl;
 
+// t_rank is the concrete ranker (rank_bm25 or rank_impact) so scoring
+// calls are resolved at compile time
 template<class t_pl = block_postings_list<128>,
-         class t_rank = generic_rank>
+         class t_rank = rank_bm25>
 class idx_invfile {
 public:
   using size_type = sdsl::int_vector<>::size_type;
@@ -31,39 +39,133 @@ private:
     typename plist_type::const_iterator end;
     double list_max_score;
     double f_t;
+    double w_qt; // term weight of the list, fixed for the query
+    plist_type* list = nullptr;
     plist_wrapper() = default;
-    plist_wrapper(plist_type& pl) {
+    plist_wrapper(plist_type& pl, const double weight) {
+      reset(pl, weight);
+    }
+    // Points a reused wrapper at pl, the cursor keeps its decode buffers
+    void reset(plist_type& pl, const double weight) {
+      w_qt = weight;
+      list = &pl;
       f_t = pl.size();
-      cur = pl.begin();
+      cur.reset(pl, 0);
       end = pl.end();
       list_max_score = pl.list_max_score();
     }
   };
+  // Cursors and scratch space of the queries of one thread, kept across
+  // queries so the steady state query path does not allocate
+  struct query_context {
+    std::vector<plist_wrapper> pl_data;
+    std::vector<plist_wrapper*> postings_lists;
+    // cursors of the docid ranges of an intra-query parallel worker
+    std::vector<plist_wrapper> range_data;
+    std::vector<plist_wrapper*> range_lists;
+    std::vector<double> max_prefix;
+    std::vector<double> block_max_prefix;
+    topk_queue heap;
+    // blocks decoded by the queries of the running batch
+    typename plist_type::block_cache_type batch_blocks;
+    bool in_batch = false;
+  };
 private:
   std::vector<plist_type> m_postings_lists;
+  mapped_file m_postings_map; // only used when the lists are mapped
   std::unique_ptr<ranker_type> ranker;
+  // Both caches start empty: the score cache is sized once dynamic
+  // caching is enabled, either one grows to hold a loaded cache file
   cache_t cache;
   cache_t term_cache;
-  bool dyn_cache;
-  std::uint32_t cache_hit;
-  std::uint32_t cache_miss;
-  std::uint32_t subset_found;
-  std::uint32_t subset_not_found;
-  double (*lowerbound_threshold)(const query_t&, const cache_t&);
+  size_t m_cache_budget = cache_t::DEFAULT_BUDGET;
+  // queries may run concurrently, the score caches take concurrent
+  // inserts and the counters are atomic
+  bool dyn_cache = false;
+  std::atomic<std::uint32_t> cache_hit{0};
+  std::atomic<std::uint32_t> cache_miss{0};
+  std::atomic<std::uint32_t> subset_found{0};
+  std::atomic<std::uint32_t> subset_not_found{0};
+  double (*lowerbound_threshold)(const query_t&, const cache_t&) =
+      &naive_threshold;
   double (*lowerbound_threshold_term)(const query_t&, const cache_t&,
-                                      const cache_t&);
+                                      const cache_t&) = nullptr;
+  // intra-query parallelism of BMW disjunctive queries, the pool threads
+  // help the queries of all query threads
+  size_t m_intra_threads = 1;
+  std::unique_ptr<intra_query_pool> m_intra_pool;
+  // queries shorter than this are not worth splitting
+  size_t m_parallel_min_postings = 1 << 16;
+  // Every block maximum is an exact integer, block-max tests sum quanta
+  bool m_integer_block_max = false;
+  // algorithm of disjunctive queries
+  query_algorithm m_algorithm = PIVOT;
+  // docid ranges dealt to each thread, more ranges balance better
+  static const size_t RANGES_PER_THREAD = 8;
+  // decoded blocks a batch keeps, docids and freqs take 1 KiB for blocks
+  // of 128 postings, so the slab of a batching thread takes 4 MiB
+  static const size_t BATCH_CACHE_BLOCKS = 1 << 12;
+
+  static query_context& thread_context() {
+    static thread_local query_context context;
+    return context;
+  }
 
-  void load_cache(const std::string& cache_file, cache_t& load_cache) {
+  // Top-k heap of the calling thread, reused by all its queries
+  static topk_queue& thread_heap(const size_t k) {
+    topk_queue& heap = thread_context().heap;
+    heap.reset(k);
+    return heap;
+  }
+
+  // Loads "term term ...;score" lines, the terms are mapped through the
+  // dictionary and the entry is keyed on their sorted ids
+  void load_cache(const std::string& cache_file, cache_t& load_cache,
+                  const term_dictionary& dict) {
     std::ifstream cache_fs(cache_file);
 
     if (cache_fs.is_open()) {
       std::string cache_line;
+      std::vector<std::pair<uint64_t, double>> entries;
+      std::vector<uint64_t> term_ids;
 
       while (std::getline(cache_fs, cache_line)) {
         size_t delim_pos = cache_line.find(";");
-        std::string query = cache_line.substr(0, delim_pos);
+        std::istringstream query(cache_line.substr(0, delim_pos));
         double threshold = std::stod(cache_line.substr(delim_pos + 1));
-        load_cache[query] = threshold;
+
+        term_ids.clear();
+        bool known = true;
+        for (std::string term; std::getline(query, term, ' ');) {
+          uint64_t id;
+          if (!dict.find(term, id)) {
+            known = false;
+            break;
+          }
+          term_ids.push_back(id);
+        }
+        if (!known || term_ids.empty())
+          continue;
+        std::sort(term_ids.begin(), term_ids.end());
+        entries.emplace_back(subset_key(term_ids.data(), term_ids.size()),
+                             threshold);
+      }
+
+      // a static cache is kept whole and pinned, grow beyond the budget
+      // until no bucket overflows
+      size_t budget = cache_t::budget_for(entries.size());
+      bool loaded = false;
+      while (!loaded) {
+        if (load_cache.budget() < budget)
+          load_cache.resize(budget);
+        loaded = true;
+        for (const auto& entry : entries) {
+          if (!load_cache.insert(entry.first, entry.second, true)) {
+            loaded = false;
+            budget = 2 * load_cache.budget();
+            break;
+          }
+        }
       }
     } else {
       std::cerr << "Cannot load cache with file " << cache_file << "\n";
@@ -72,32 +174,79 @@ private:
 
 public:
   idx_invfile() = default;
+  idx_invfile(const idx_invfile&) = delete;
+  idx_invfile& operator=(const idx_invfile&) = delete;
   double m_F;
-  double m_conjunctive_max;
 
   // Search constructor
-  idx_invfile(std::string& postings_file, const double F) :
-      m_F(F)
+  idx_invfile(std::string& postings_file, const double F,
+              const bool use_mmap = false)
   {
+    load_postings(postings_file, F, use_mmap);
+  }
 
-    std::ifstream ifs(postings_file);
-    if (ifs.is_open() != true){
-      std::cerr << "Could not open file: " <<  postings_file << std::endl;
-      exit(EXIT_FAILURE);
+  void load_postings(std::string& postings_file, const double F,
+                     const bool use_mmap = false) {
+    m_F = F;
+    if (use_mmap) {
+      map_postings(postings_file);
+    } else {
+      std::ifstream ifs(postings_file);
+      if (ifs.is_open() != true){
+        std::cerr << "Could not open file: " <<  postings_file << std::endl;
+        exit(EXIT_FAILURE);
+      }
+      size_t num_lists;
+      read_member(num_lists,ifs);
+      m_postings_lists.resize(num_lists);
+      for (size_t i=0;i<num_lists;i++) {
+        m_postings_lists[i].load(ifs);
+      }
     }
+    m_integer_block_max = false;
+    for (const auto& pl : m_postings_lists) {
+      if (pl.size() == 0)
+        continue;
+      m_integer_block_max = pl.integer_block_max();
+      if (!m_integer_block_max)
+        break;
+    }
+  }
+
+  // Maps the postings file and creates every list as a view over its
+  // region. List offsets come from the directory written next to the
+  // postings by build_index; without it the list headers are walked.
+  void map_postings(const std::string& postings_file) {
+    m_postings_map = mapped_file(postings_file);
+    const char* base = m_postings_map.data();
+    const char* ptr = base;
     size_t num_lists;
-    read_member(num_lists,ifs);
+    read_mapped(num_lists, ptr);
     m_postings_lists.resize(num_lists);
-    for (size_t i=0;i<num_lists;i++) {
-      m_postings_lists[i].load(ifs);
+
+    std::string dir_file = postings_file.substr(0, postings_file.rfind('.'))
+                           + ".dir";
+    if (file_exists(dir_file)) {
+      mapped_file directory(dir_file);
+      const char* dir_ptr = directory.data();
+      size_t num_offsets;
+      read_mapped(num_offsets, dir_ptr);
+      if (num_offsets != num_lists) {
+        std::cerr << "Postings directory does not match " << postings_file
+                  << ". Please rebuild." << std::endl;
+        exit(EXIT_FAILURE);
+      }
+      const uint64_t* offsets = (const uint64_t*)dir_ptr;
+      for (size_t i=0;i<num_lists;i++) {
+        m_postings_lists[i].map(base + offsets[i]);
+      }
+    } else {
+      std::cerr << "No postings directory found, walking list headers."
+                << std::endl;
+      for (size_t i=0;i<num_lists;i++) {
+        ptr = m_postings_lists[i].map(ptr);
+      }
     }
-    dyn_cache = false;
-    cache_hit = 0;
-    cache_miss = 0;
-    subset_found = 0;
-    subset_not_found = 0;
-    lowerbound_threshold = &naive_threshold;
-    lowerbound_threshold_term = nullptr;
   }
 
   auto serialize(std::ostream& out,
@@ -117,32 +266,54 @@ public:
   }
 
   // Loads the ranker data
-  void load(std::vector<uint64_t> doc_len, uint64_t terms, uint64_t num_docs,
-            postings_form postings_type){
-    if (postings_type == FREQUENCY) {
-      ranker = std::unique_ptr<ranker_type>(new rank_bm25(doc_len, terms, num_docs));
-    }
-    else if (postings_type == QUANTIZED) {
-      ranker = std::unique_ptr<ranker_type>(new rank_impact);
-    }
+  void load(std::vector<uint64_t> doc_len, uint64_t terms, uint64_t num_docs){
+    ranker = std::unique_ptr<ranker_type>(
+        new ranker_type(std::move(doc_len), terms, num_docs));
+  }
+
+  void load_cache(const std::string& cache_file,
+                  const term_dictionary& dict) {
+    load_cache(cache_file, cache, dict);
+  }
+
+  void load_term_cache(const std::string& cache_file,
+                       const term_dictionary& dict) {
+    load_cache(cache_file, term_cache, dict);
   }
 
-  void load_cache(const std::string& cache_file) {
-    load_cache(cache_file, cache);
+  // Threads a single BMW disjunctive query is split over
+  void set_intra_query_threads(const size_t threads) {
+    m_intra_threads = std::max<size_t>(1, threads);
+    m_intra_pool.reset();
+    if (m_intra_threads > 1)
+      m_intra_pool.reset(new intra_query_pool(m_intra_threads - 1));
   }
 
-  void load_term_cache(const std::string& cache_file) {
-    load_cache(cache_file, term_cache);
+  // Algorithm of disjunctive queries, BLOCK_MAXSCORE needs a BMW index
+  void set_query_algorithm(const query_algorithm algorithm) {
+    m_algorithm = algorithm;
   }
 
+  // Only SAAT indexes stop after a budget of postings
+  void set_postings_budget(const uint64_t) {}
+
   void set_dyn_cache(bool enable) {
     dyn_cache = enable;
+    if (dyn_cache && cache.budget() == 0)
+      cache.resize(m_cache_budget);
   }
 
   void reset_cache() {
     cache.clear();
   }
 
+  // Memory budget of the dynamic score cache, drops its entries
+  void set_cache_budget(const size_t budget_bytes) {
+    m_cache_budget = budget_bytes;
+    if (dyn_cache)
+      cache.resize(m_cache_budget);
+  }
+
   void set_threshold_method(const std::string& method) {
     if (method == "HR1")
       lowerbound_threshold = &hr1_threshold;
@@ -164,6 +335,25 @@ public:
       lowerbound_threshold = &naive_threshold;
   }
 
+  // Lower bound for the initial heap threshold from the score caches
+  double estimate_threshold(const query_t& query, query_stat& stat) {
+    double threshold = 0.0;
+
+    if (lowerbound_threshold_term)
+      threshold = lowerbound_threshold_term(query, cache, term_cache);
+    else
+      threshold = lowerbound_threshold(query, cache);
+
+    stat.lowerbound_threshold = threshold;
+
+    if (threshold > 0.0)
+      subset_found++;
+    else
+      subset_not_found++;
+
+    return threshold;
+  }
+
   // Finds the posting with the least number of items remaining other than
   // the current ID
   typename std::vector<plist_wrapper*>::iterator
@@ -187,6 +377,7 @@ public:
     return end;
   }
 
+  // Initial list order of a query, later moves keep it with bubble_down
   void sort_list_by_id(std::vector<plist_wrapper*>& plists) {
     // delete if necessary
     auto del_itr = plists.begin();
@@ -204,6 +395,44 @@ public:
     std::sort(plists.begin(),plists.end(),id_sort);
   }
 
+  // Moves the list at pos, which was advanced, down to its place in docid
+  // order. The lists after it must be in order. A finished list sinks below
+  // all unfinished ones.
+  void bubble_down(std::vector<plist_wrapper*>& plists, size_t pos) {
+    auto list_end = plists.size();
+    if (plists[pos]->cur == plists[pos]->end) {
+      while (pos + 1 < list_end &&
+             plists[pos+1]->cur != plists[pos+1]->end) {
+        std::swap(plists[pos], plists[pos+1]);
+        pos++;
+      }
+      return;
+    }
+    uint64_t docid = plists[pos]->cur.docid();
+    while (pos + 1 < list_end && plists[pos+1]->cur != plists[pos+1]->end &&
+           docid > plists[pos+1]->cur.docid()) {
+      std::swap(plists[pos], plists[pos+1]);
+      pos++;
+    }
+  }
+
+  // Restores the list order after the first num_moved lists were advanced
+  // past the pivot, only those are bubbled down. Finished lists end up at
+  // the back and are dropped with pop_back.
+  void reorder_lists(std::vector<plist_wrapper*>& plists,
+                     const size_t num_moved) {
+    for (size_t i = num_moved; i-- > 0;) {
+      bubble_down(plists, i);
+    }
+    drop_finished_lists(plists);
+  }
+
+  void drop_finished_lists(std::vector<plist_wrapper*>& plists) {
+    while (!plists.empty() && plists.back()->cur == plists.back()->end) {
+      plists.pop_back();
+    }
+  }
+
   // WAND-Forwarding: Forwards smallest list to provided ID
   void forward_lists(std::vector<plist_wrapper*>& postings_lists,
        const typename std::vector<plist_wrapper*>::iterator& pivot_list,
@@ -213,21 +442,9 @@ public:
     // advance the smallest list to the new id
     (*smallest_itr)->cur.skip_to_id(id);
 
-    if ((*smallest_itr)->cur == (*smallest_itr)->end) {
-      // list is finished! reorder list by id
-      sort_list_by_id(postings_lists);
-      return;
-    }
-
-    // bubble it down!
-    auto next = smallest_itr + 1;
-    auto list_end = postings_lists.end();
-    while (next != list_end &&
-           (*smallest_itr)->cur.docid() > (*next)->cur.docid()) {
-      std::swap(*smallest_itr,*next);
-      smallest_itr = next;
-      next++;
-    }
+    // bubble it down! a finished list is dropped
+    bubble_down(postings_lists, smallest_itr - postings_lists.begin());
+    drop_finished_lists(postings_lists);
   }
 
   // BMW-Forwarding: Forwards beyond current block config
@@ -265,20 +482,9 @@ public:
     // Advance the smallest list to our new candidate
     (*smallest_iter)->cur.skip_to_id(candidate_id);
 
-    // If the smallest list is finished, reorder the lists
-    if ((*smallest_iter)->cur == (*smallest_iter)->end) {
-      sort_list_by_id(postings_lists);
-      return;
-    }
-
-    // Bubble it down.
-    auto next = smallest_iter + 1;
-    while (next != list_end &&
-          (*smallest_iter)->cur.docid() > (*next)->cur.docid()) {
-      std::swap(*smallest_iter, *next);
-      smallest_iter = next;
-      ++next;
-    }
+    // Bubble it down, a finished list is dropped
+    bubble_down(postings_lists, smallest_iter - postings_lists.begin());
+    drop_finished_lists(postings_lists);
   }
 
   // Block-Max specific candidate test. Tests that the current pivot's block-max
@@ -291,6 +497,18 @@ public:
                       const uint64_t doc_id, bool heap_full = false){
 
     auto iter = postings_lists.begin();
+    if (m_integer_block_max) {
+      uint64_t block_max_quanta = (*pivot_list)->cur.block_max_quanta();
+      while (iter != pivot_list) {
+        uint64_t bid = (*iter)->cur.block_containing_id(doc_id);
+        block_max_quanta += (*iter)->cur.block_max_quanta(bid);
+        ++iter;
+      }
+      double block_max_score = block_max_quanta;
+      return {heap_full ? block_max_score > threshold
+                        : block_max_score >= threshold, block_max_score};
+    }
+
     double block_max_score = (*pivot_list)->cur.block_max(); // pivot blockmax
 
     // Lists preceding pivot list block max scores
@@ -308,14 +526,21 @@ public:
     return {false,block_max_score};
   }
 
-  // Returns a pivot document and its candidate (UB estimated) score.
-  // Conjunctive pivot selection, can be used by BMW and Wand algos
-  std::pair<typename std::vector<plist_wrapper*>::iterator, double>
-  determine_candidate(std::vector<plist_wrapper*>& postings_lists) {
-    // Return the doc in the last list since it's furtherest along (and
-    // the only doc that may contain ALL terms). Also return our
-    // pre-computed sum of all UB scores (was computed upon recieving query).
-    return {postings_lists.end() - 1, m_conjunctive_max};
+  // Number of postings of all query lists
+  size_t total_postings(const std::vector<plist_wrapper*>& postings_lists) const {
+    size_t total = 0;
+    for (const auto* pl : postings_lists)
+      total += pl->f_t;
+    return total;
+  }
+
+  // Sum of all list UB scores, the candidate score of conjunctive pivots
+  double conjunctive_max_score(
+      const std::vector<plist_wrapper*>& postings_lists) const {
+    double conjunctive_max = 0.0;
+    for (const auto* pl : postings_lists)
+      conjunctive_max += pl->list_max_score;
+    return conjunctive_max;
   }
 
   // Returns a pivot document and its candidate (UB estimated) score.
@@ -349,25 +574,21 @@ public:
 
   // Evaluates the pivot document
   double evaluate_pivot(std::vector<plist_wrapper*>& postings_lists,
-                        std::priority_queue<doc_score,
-                        std::vector<doc_score>,
-                        std::greater<doc_score>>& heap,
+                        topk_queue& heap,
                         double potential_score,
                         const double threshold,
                         const size_t k, bool& heap_full) {
 
     auto doc_id = postings_lists[0]->cur.docid(); //Pivot ID
     double doc_score = 0;
-    double W_d = ranker->doc_length(doc_id);
+    double K_d = ranker->doc_norm(doc_id);
     auto itr = postings_lists.begin();
     auto end = postings_lists.end();
     // Iterate postings
     while (itr != end) {
       // Score the document if
       if ((*itr)->cur.docid() == doc_id) {
-        double contrib = ranker->calculate_docscore((*itr)->cur.freq(),
-                                                   (*itr)->f_t,
-                                                   W_d);
+        double contrib = ranker->score((*itr)->cur.freq(), (*itr)->w_qt, K_d);
         doc_score += contrib;
         potential_score += contrib;
         potential_score -= (*itr)->list_max_score; //Incremental refinement
@@ -391,16 +612,15 @@ public:
     }
 
     if (heap_full && doc_score > threshold) {
-      heap.pop();
-      heap.push({doc_id, doc_score});
+      heap.replace_top({doc_id, doc_score});
     } else if (!heap_full && doc_score >= threshold) {
       heap.push({doc_id, doc_score});
     }
 
-    heap_full = heap.size() == k;
+    heap_full = heap.full();
 
-    // resort
-    sort_list_by_id(postings_lists);
+    // only the lists up to itr moved past the pivot
+    reorder_lists(postings_lists, itr - postings_lists.begin());
 
     if (heap_full)
       return heap.top().score;
@@ -410,16 +630,14 @@ public:
 
   // Block-Max pivot evaluation
   double evaluate_pivot_bmw(std::vector<plist_wrapper*>& postings_lists,
-                            std::priority_queue<doc_score,
-                            std::vector<doc_score>,
-                            std::greater<doc_score>>& heap,
+                            topk_queue& heap,
                             double potential_score,
                             const double threshold,
                             const size_t k, bool& heap_full) {
 
     uint64_t doc_id = postings_lists[0]->cur.docid(); // pivot
     double doc_score = 0;
-    double W_d = ranker->doc_length(doc_id);
+    double K_d = ranker->doc_norm(doc_id);
     auto itr = postings_lists.begin();
     auto end = postings_lists.end();
 
@@ -427,9 +645,7 @@ public:
     while (itr != end) {
       // If we have the pivot, contribute the score
       if ((*itr)->cur.docid() == doc_id) {
-        double contrib = ranker->calculate_docscore((*itr)->cur.freq(),
-                                                   (*itr)->f_t,
-                                                   W_d);
+        double contrib = ranker->score((*itr)->cur.freq(), (*itr)->w_qt, K_d);
         doc_score += contrib;
         potential_score += contrib;
         // Differs from WAND version as we use BM scores for estimation
@@ -455,16 +671,15 @@ public:
     }
 
     if (heap_full && doc_score > threshold) {
-      heap.pop();
-      heap.push({doc_id, doc_score});
+      heap.replace_top({doc_id, doc_score});
     } else if (!heap_full && doc_score >= threshold) {
       heap.push({doc_id, doc_score});
     }
 
-    heap_full = heap.size() == k;
+    heap_full = heap.full();
 
-    // resort
-    sort_list_by_id(postings_lists);
+    // only the lists up to itr moved past the pivot
+    reorder_lists(postings_lists, itr - postings_lists.begin());
 
 
     if (heap_full)
@@ -481,24 +696,11 @@ public:
                                   query_stat& stat) {
     result res;
     // heap containing the top-k docs
-    std::priority_queue<doc_score,std::vector<doc_score>,
-                        std::greater<doc_score>> score_heap;
+    topk_queue& score_heap = thread_heap(k);
 
     bool heap_full = false;
     // init list processing
-    double threshold = 0.0;
-
-    if (lowerbound_threshold_term)
-      threshold = lowerbound_threshold_term(query, cache, term_cache);
-    else
-      threshold = lowerbound_threshold(query, cache);
-
-    stat.lowerbound_threshold = threshold;
-
-    if (threshold > 0.0)
-      subset_found++;
-    else
-      subset_not_found++;
+    double threshold = estimate_threshold(query, stat);
 
     // Initial Sort, get the pivot and its potential score
     sort_list_by_id(postings_lists);
@@ -531,60 +733,151 @@ public:
     stat.actual_threshold = threshold;
 
     // return the top-k results
-    res.list.resize(score_heap.size());
-    for (size_t i=0;i<res.list.size();i++) {
-      auto min = score_heap.top(); score_heap.pop();
-      res.list[res.list.size()-1-i] = min;
-    }
+    score_heap.sorted(res.list);
     return res;
   }
 
-  // Wand Conjunctive Algorithm
-  result process_wand_conjunctive(std::vector<plist_wrapper*>& postings_lists,
-                                  const size_t k) {
-    result res;
-    // heap containing the top-k docs
-    std::priority_queue<doc_score,std::vector<doc_score>,
-                        std::greater<doc_score>> score_heap;
+  // Upper bound of a conjunctive candidate from the blocks of every list
+  // that may hold doc_id, the lists are not moved. next_id is the first
+  // docid past the block configuration, past_end is set when a list has
+  // no docid left >= doc_id.
+  double conjunctive_block_max(std::vector<plist_wrapper*>& postings_lists,
+                               const uint64_t doc_id, uint64_t& next_id,
+                               bool& past_end) {
+    uint64_t block_max_quanta = 0;
+    double block_max_score = 0;
+    next_id = std::numeric_limits<uint64_t>::max();
+    for (auto* pl : postings_lists) {
+      uint64_t bid = pl->cur.block_containing_id(doc_id);
+      uint64_t rep = pl->cur.block_rep(bid);
+      if (rep < doc_id) {
+        past_end = true;
+        return 0;
+      }
+      next_id = std::min(next_id, rep + 1);
+      if (m_integer_block_max)
+        block_max_quanta += pl->cur.block_max_quanta(bid);
+      else
+        block_max_score += pl->cur.block_max(bid);
+    }
+    past_end = false;
+    return m_integer_block_max ? block_max_quanta : block_max_score;
+  }
 
-    // init list processing
-    double threshold = 0.0f;
-    // Initial Sort, get the pivot and its potential score
-    sort_list_by_id(postings_lists);
-    size_t initial = postings_lists.size();
-    auto pivot_and_score = determine_candidate(postings_lists);
-    auto pivot_list = std::get<0>(pivot_and_score);
-    auto potential_score = std::get<1>(pivot_and_score);
+  // Scores a document found in every list. The bound of each list (its
+  // block max or list max) is swapped for its score as we go, scoring
+  // stops once the document can no longer beat the threshold.
+  double evaluate_conjunctive(std::vector<plist_wrapper*>& postings_lists,
+                              topk_queue& heap,
+                              double potential_score,
+                              const double threshold, const size_t k,
+                              bool& heap_full, const bool block_max) {
+    uint64_t doc_id = postings_lists[0]->cur.docid();
+    double doc_score = 0;
+    double K_d = ranker->doc_norm(doc_id);
+    for (auto* pl : postings_lists) {
+      double contrib = ranker->score(pl->cur.freq(), pl->w_qt, K_d);
+      doc_score += contrib;
+      potential_score += contrib;
+      potential_score -= block_max ? pl->cur.block_max() : pl->list_max_score;
+      if (heap_full && potential_score <= threshold)
+        return threshold;
+    }
 
-    // While our pivot doc is not the end of the PL and we have not exhausted
-    // any of our PL's
-    while (pivot_list != postings_lists.end() &&
-                postings_lists.size() == initial) {
-      // If the first posting ID is that of the pivot, evaluate!
-      if (postings_lists[0]->cur.docid() == (*pivot_list)->cur.docid()) {
-          // threshold = evaluate_pivot(postings_lists,
-          //                            score_heap,
-          //                            potential_score,
-          //                            threshold,
-          //                            k);
+    if (heap_full && doc_score > threshold) {
+      heap.replace_top({doc_id, doc_score});
+    } else if (!heap_full) {
+      heap.push({doc_id, doc_score});
+    }
+
+    heap_full = heap.full();
+
+    if (heap_full)
+      return heap.top().score;
+
+    return threshold;
+  }
+
+  // Conjunctive traversal shared by WAND and BMW. The shortest list
+  // proposes candidates and the other lists skip_to_id them, shortest
+  // first; a list landing past the candidate proposes the next one. With
+  // block_max, candidates whose block maximums cannot beat the threshold
+  // are skipped without decoding, along with the rest of their blocks.
+  // Returns the final threshold.
+  double conjunctive_traversal(std::vector<plist_wrapper*>& postings_lists,
+                               topk_queue& score_heap,
+                               const size_t k, const bool block_max) {
+    double threshold = 0.0;
+    bool heap_full = false;
+    // an empty list empties the intersection
+    size_t initial = postings_lists.size();
+    sort_list_by_id(postings_lists);
+    if (postings_lists.empty() || postings_lists.size() != initial)
+      return threshold;
+
+    std::sort(postings_lists.begin(), postings_lists.end(),
+              [](const plist_wrapper* a, const plist_wrapper* b) {
+                return a->f_t < b->f_t;
+              });
+    double conjunctive_max = conjunctive_max_score(postings_lists);
+    plist_wrapper* lead = postings_lists[0];
+
+    while (lead->cur != lead->end) {
+      // no document can beat the heap anymore
+      if (heap_full && conjunctive_max <= threshold)
+        break;
+      uint64_t candidate_id = lead->cur.docid();
+      double potential_score = conjunctive_max;
+
+      if (block_max) {
+        uint64_t next_id;
+        bool past_end;
+        potential_score = conjunctive_block_max(postings_lists, candidate_id,
+                                                next_id, past_end);
+        if (past_end)
+          break;
+        if (heap_full && potential_score <= threshold) {
+          lead->cur.skip_to_id(next_id);
+          continue;
+        }
       }
-      // We must forward the lists before the pivot up to our pivot doc
-      else {
-        forward_lists(postings_lists,pivot_list,(*pivot_list)->cur.docid());
+
+      // align the other lists on the candidate
+      bool aligned = true;
+      for (size_t i = 1; i < postings_lists.size(); i++) {
+        auto* pl = postings_lists[i];
+        pl->cur.skip_to_id(candidate_id);
+        if (pl->cur == pl->end)
+          return threshold;
+        if (pl->cur.docid() != candidate_id) {
+          lead->cur.skip_to_id(pl->cur.docid());
+          aligned = false;
+          break;
+        }
       }
-      // Grsb the next pivot and its potential score
-      pivot_and_score = determine_candidate(postings_lists);
-      pivot_list = std::get<0>(pivot_and_score);
-      potential_score = std::get<1>(pivot_and_score);
+      if (!aligned)
+        continue;
 
+      threshold = evaluate_conjunctive(postings_lists, score_heap,
+                                       potential_score, threshold, k,
+                                       heap_full, block_max);
+      ++(lead->cur);
     }
+    return threshold;
+  }
+
+  // Wand Conjunctive Algorithm
+  result process_wand_conjunctive(std::vector<plist_wrapper*>& postings_lists,
+                                  const size_t k, query_stat& stat) {
+    result res;
+    // heap containing the top-k docs
+    topk_queue& score_heap = thread_heap(k);
+
+    stat.actual_threshold = conjunctive_traversal(postings_lists, score_heap,
+                                                  k, false);
 
     // return the top-k results
-    res.list.resize(score_heap.size());
-    for (size_t i=0;i<res.list.size();i++) {
-      auto min = score_heap.top(); score_heap.pop();
-      res.list[res.list.size()-1-i] = min;
-    }
+    score_heap.sorted(res.list);
     return res;
   }
 
@@ -598,36 +891,25 @@ public:
     return static_cast<double>(subset_found) / static_cast<double>(total);
   }
 
-  // BlockMax Wand Disjunctive
-  result process_bmw_disjunctive(std::vector<plist_wrapper*>& postings_lists,
-                                 const query_t& query,
-                                 const size_t k, query_stat& stat) {
-    result res;
-    // heap containing the top-k docs
-    std::priority_queue<doc_score,std::vector<doc_score>,
-                        std::greater<doc_score>> score_heap;
-    bool heap_full = false;
-    double threshold = 0.0;
-
-    if (lowerbound_threshold_term)
-      threshold = lowerbound_threshold_term(query, cache, term_cache);
-    else
-      threshold = lowerbound_threshold(query, cache);
-
-    stat.lowerbound_threshold = threshold;
-
-    if (threshold > 0.0)
-      subset_found++;
-    else
-      subset_not_found++;
-
+  // BlockMax Wand Disjunctive traversal over the docids below max_docid,
+  // returns the final threshold. When a shared threshold is given it is
+  // used for pruning and raised whenever the local heap is full.
+  double bmw_disjunctive_traversal(std::vector<plist_wrapper*>& postings_lists,
+                                   topk_queue& score_heap,
+                                   double threshold, bool& heap_full,
+                                   const size_t k,
+                                   const uint64_t max_docid =
+                                       std::numeric_limits<uint64_t>::max(),
+                                   std::atomic<double>* shared_threshold =
+                                       nullptr) {
     sort_list_by_id(postings_lists);
     auto pivot_and_score = determine_candidate(
-        postings_lists, threshold);
+        postings_lists, threshold, heap_full);
     auto pivot_list = std::get<0>(pivot_and_score);
 
     // While we have got documents left to evaluate
-    while (pivot_list != postings_lists.end()) {
+    while (pivot_list != postings_lists.end() &&
+           (*pivot_list)->cur.docid() < max_docid) {
       uint64_t candidate_id = (*pivot_list)->cur.docid();
       // Second level candidate check
       auto candidate_and_score = potential_candidate(
@@ -641,6 +923,9 @@ public:
           threshold = evaluate_pivot_bmw(
               postings_lists, score_heap, potential_score, threshold, k,
               heap_full);
+          if (shared_threshold)
+            threshold = share_threshold(*shared_threshold, threshold,
+                                        heap_full);
         }
         // Need to forward list before the pivot
         else {
@@ -659,99 +944,329 @@ public:
       potential_score = std::get<1>(pivot_and_score);
     }
 
+    return threshold;
+  }
+
+  // Publishes a full heap's threshold to the other range workers and
+  // returns the highest threshold known so far. A doc has to beat the
+  // k'th best score of some range to make the merged top-k, so pruning
+  // with it stays rank-safe.
+  double share_threshold(std::atomic<double>& shared_threshold,
+                         const double threshold, const bool heap_full) {
+    double shared = shared_threshold.load();
+    if (heap_full) {
+      while (shared < threshold &&
+             !shared_threshold.compare_exchange_weak(shared, threshold)) {
+      }
+    }
+    return std::max(threshold, shared);
+  }
+
+  // BlockMax Wand Disjunctive
+  result process_bmw_disjunctive(std::vector<plist_wrapper*>& postings_lists,
+                                 const query_t& query,
+                                 const size_t k, query_stat& stat) {
+    result res;
+    // heap containing the top-k docs
+    topk_queue& score_heap = thread_heap(k);
+    bool heap_full = false;
+    double threshold = estimate_threshold(query, stat);
+
+    threshold = bmw_disjunctive_traversal(postings_lists, score_heap,
+                                          threshold, heap_full, k);
+
     if (dyn_cache)
-      cache[query.query_str] = threshold;
+      cache.insert(query_key(query), threshold);
 
     stat.actual_threshold = threshold;
 
     // return the top-k results
-    res.list.resize(score_heap.size());
-    for (size_t i=0;i<res.list.size();i++) {
-      auto min = score_heap.top(); score_heap.pop();
-      res.list[res.list.size()-1-i] = min;
+    score_heap.sorted(res.list);
+
+    return res;
+  }
+
+  // BlockMax Wand Disjunctive split over docid ranges. Every worker runs
+  // BMW on the ranges it takes (or steals) with its own heap, the workers
+  // share their threshold and the heaps are merged into the top-k.
+  result process_bmw_disjunctive_parallel(
+      std::vector<plist_wrapper*>& postings_lists, const query_t& query,
+      const size_t k, query_stat& stat) {
+    result res;
+    double init_threshold = estimate_threshold(query, stat);
+
+    // docid span covered by the query lists
+    uint64_t first_id = std::numeric_limits<uint64_t>::max();
+    uint64_t end_id = 0;
+    for (auto* pl : postings_lists) {
+      if (pl->cur == pl->end)
+        continue;
+      first_id = std::min(first_id, pl->cur.docid());
+      end_id = std::max(end_id,
+                        pl->cur.block_rep(pl->cur.num_blocks() - 1) + 1);
     }
 
+    docid_range_stealer ranges(first_id, end_id, m_intra_threads,
+                               RANGES_PER_THREAD);
+    std::atomic<double> shared_threshold(init_threshold);
+    std::vector<std::vector<doc_score>> worker_results(m_intra_threads);
+
+    auto process_ranges = [&](const size_t w) {
+      topk_queue& score_heap = thread_heap(k);
+      bool heap_full = false;
+      double threshold = init_threshold;
+      uint64_t range_begin, range_end;
+
+      query_context& context = thread_context();
+      auto& range_data = context.range_data;
+      auto& range_lists = context.range_lists;
+      if (range_data.size() < postings_lists.size())
+        range_data.resize(postings_lists.size());
+      // The worker keeps one cursor per list. Its own ranges come in
+      // increasing order, so cursors only move forward, unless a range
+      // stolen from another worker lies behind them.
+      uint64_t cursors_at = std::numeric_limits<uint64_t>::max();
+
+      while (ranges.next(w, range_begin, range_end)) {
+        bool rewind = range_begin < cursors_at;
+        range_lists.clear();
+        for (size_t i = 0; i < postings_lists.size(); i++) {
+          if (rewind)
+            range_data[i].reset(*postings_lists[i]->list,
+                                postings_lists[i]->w_qt);
+          if (range_data[i].cur != range_data[i].end)
+            range_data[i].cur.skip_to_id(range_begin);
+          range_lists.push_back(&range_data[i]);
+        }
+        cursors_at = range_end;
+
+        threshold = std::max(threshold, shared_threshold.load());
+        threshold = bmw_disjunctive_traversal(range_lists, score_heap,
+                                              threshold, heap_full, k,
+                                              range_end, &shared_threshold);
+      }
+
+      score_heap.sorted(worker_results[w]);
+    };
+
+    m_intra_pool->run(m_intra_threads, process_ranges);
+
+    // merge the range heaps
+    for (const auto& worker_result : worker_results)
+      res.list.insert(res.list.end(), worker_result.begin(),
+                      worker_result.end());
+    std::sort(res.list.begin(), res.list.end(), std::greater<doc_score>());
+    if (res.list.size() > k)
+      res.list.resize(k);
+
+    double threshold = init_threshold;
+    if (res.list.size() == k)
+      threshold = std::max(threshold, res.list.back().score);
+
+    if (dyn_cache)
+      cache.insert(query_key(query), threshold);
+
+    stat.actual_threshold = threshold;
+
     return res;
   }
 
   // BlockMax Wand Conjunctive
-  // This function is currently disabled
   result process_bmw_conjunctive(std::vector<plist_wrapper*>& postings_lists,
-                                 const size_t k){
+                                 const size_t k, query_stat& stat) {
     result res;
     // heap containing the top-k docs
-    std::priority_queue<doc_score,std::vector<doc_score>,
-                        std::greater<doc_score>> score_heap;
+    topk_queue& score_heap = thread_heap(k);
+
+    stat.actual_threshold = conjunctive_traversal(postings_lists, score_heap,
+                                                  k, true);
+
+    // return the top-k results
+    score_heap.sorted(res.list);
+    return res;
+  }
+
+  // MaxScore Disjunctive. Lists are ordered by increasing max score and
+  // the longest prefix whose max scores sum below the threshold is
+  // non-essential: a document only in those lists cannot make the heap.
+  // Candidates come from the essential lists alone and are looked up in
+  // the non-essential lists, highest first, while they can still make the
+  // heap. With block_max the bounds of a candidate are refined with the
+  // block maximums of the blocks holding it, before anything is decoded
+  // for the non-essential lists.
+  result process_maxscore(std::vector<plist_wrapper*>& postings_lists,
+                          const query_t& query, const size_t k,
+                          query_stat& stat, const bool block_max) {
+    result res;
+    // heap containing the top-k docs
+    topk_queue& score_heap = thread_heap(k);
+    bool heap_full = false;
+    double threshold = estimate_threshold(query, stat);
 
-    // init list processing , grab first pivot and potential score
-    double threshold = 0;
     sort_list_by_id(postings_lists);
-    auto pivot_and_score = determine_candidate(postings_lists);
-    auto pivot_list = std::get<0>(pivot_and_score);
-    size_t initial = postings_lists.size();
+    std::sort(postings_lists.begin(), postings_lists.end(),
+              [](const plist_wrapper* a, const plist_wrapper* b) {
+                return a->list_max_score < b->list_max_score;
+              });
+    const size_t num_lists = postings_lists.size();
+    // max_prefix[i] bounds the score from lists 0..i-1
+    query_context& context = thread_context();
+    auto& max_prefix = context.max_prefix;
+    max_prefix.assign(num_lists + 1, 0.0);
+    for (size_t i = 0; i < num_lists; i++)
+      max_prefix[i+1] = max_prefix[i] + postings_lists[i]->list_max_score;
+    auto& block_max_prefix = context.block_max_prefix;
+    block_max_prefix.assign(num_lists + 1, 0.0);
+
+    // Can a document bounded by score still make the heap?
+    auto can_enter = [&](const double score) {
+      double pruning_threshold = threshold * m_F; //Theta push
+      return heap_full ? score > pruning_threshold
+                       : score >= pruning_threshold;
+    };
+    size_t first_essential = 0;
+    while (first_essential < num_lists &&
+           !can_enter(max_prefix[first_essential+1]))
+      first_essential++;
+
+    while (first_essential < num_lists) {
+      // the next candidate is the smallest essential docid
+      uint64_t doc_id = std::numeric_limits<uint64_t>::max();
+      for (size_t i = first_essential; i < num_lists; i++) {
+        auto* pl = postings_lists[i];
+        if (pl->cur != pl->end)
+          doc_id = std::min<uint64_t>(doc_id, pl->cur.docid());
+      }
+      if (doc_id == std::numeric_limits<uint64_t>::max())
+        break;
 
-    // While we have got documents left to evaluate
-    while (pivot_list != postings_lists.end() &&
-                         postings_lists.size() == initial) {
-      uint64_t candidate_id = (*pivot_list)->cur.docid();
-      // Second level candidate check
-      auto candidate_and_score = potential_candidate(postings_lists, pivot_list,
-                                          threshold, candidate_id);
-      auto candidate = std::get<0>(candidate_and_score);
-      auto potential_score = std::get<1>(candidate_and_score);
-      // If the document is still a candidate from BM scores
-      if (candidate) {
-        // If lists are aligned for pivot, score the doc
-        if (postings_lists[0]->cur.docid() == candidate_id) {
-          // threshold = evaluate_pivot_bmw(postings_lists, score_heap,
-          //                                potential_score, threshold, k);
+      if (block_max) {
+        // Shallow bound from the blocks holding the candidate. It holds
+        // for every docid up to skip_to: the end of those blocks, or the
+        // next posting of an essential list not on the candidate.
+        double bound = 0;
+        uint64_t skip_to = std::numeric_limits<uint64_t>::max();
+        for (size_t i = first_essential; i < num_lists; i++) {
+          auto* pl = postings_lists[i];
+          if (pl->cur == pl->end)
+            continue;
+          if (pl->cur.docid() == doc_id) {
+            bound += pl->cur.block_max();
+            skip_to = std::min<uint64_t>(skip_to, pl->cur.block_rep() + 1);
+          } else {
+            skip_to = std::min<uint64_t>(skip_to, pl->cur.docid());
+          }
         }
-        // Need to forward list before the pivot
-        else {
-          forward_lists(postings_lists,pivot_list,candidate_id);
+        // the non-essential blocks are only located, once per candidate,
+        // when their list maximums leave it a chance
+        bool bounded = !can_enter(bound + max_prefix[first_essential]);
+        if (!bounded) {
+          for (size_t i = 0; i < first_essential; i++) {
+            auto* pl = postings_lists[i];
+            double list_bound = 0;
+            if (pl->cur != pl->end) {
+              uint64_t block = pl->cur.block_containing_id(doc_id);
+              uint64_t block_end = pl->cur.block_rep(block) + 1;
+              // past its last posting a list adds nothing
+              if (block_end > doc_id) {
+                list_bound = pl->cur.block_max(block);
+                skip_to = std::min(skip_to, block_end);
+              }
+            }
+            block_max_prefix[i+1] = block_max_prefix[i] + list_bound;
+          }
+          bounded = !can_enter(bound + block_max_prefix[first_essential]);
+        }
+        if (bounded) {
+          // no document before skip_to can make the heap
+          for (size_t i = first_essential; i < num_lists; i++) {
+            auto* pl = postings_lists[i];
+            if (pl->cur != pl->end)
+              pl->cur.skip_to_id(skip_to);
+          }
+          continue;
         }
       }
-      // Use the knowledge that current block-max config can not yield a
-      // solution, and skip to the next possible fruitful configuration
-      else {
-        forward_lists_bmw(postings_lists,pivot_list,candidate_id);
+
+      double doc_score = 0;
+      double K_d = ranker->doc_norm(doc_id);
+      for (size_t i = first_essential; i < num_lists; i++) {
+        auto* pl = postings_lists[i];
+        if (pl->cur != pl->end && pl->cur.docid() == doc_id) {
+          doc_score += ranker->score(pl->cur.freq(), pl->w_qt, K_d);
+          ++(pl->cur);
+        }
+      }
+
+      // look the candidate up in the non-essential lists
+      const auto& prefix = block_max ? block_max_prefix : max_prefix;
+      bool candidate = true;
+      for (size_t i = first_essential; i > 0; i--) {
+        if (!can_enter(doc_score + prefix[i])) {
+          candidate = false;
+          break;
+        }
+        auto* pl = postings_lists[i-1];
+        if (pl->cur == pl->end)
+          continue;
+        pl->cur.skip_to_id(doc_id);
+        if (pl->cur != pl->end && pl->cur.docid() == doc_id)
+          doc_score += ranker->score(pl->cur.freq(), pl->w_qt, K_d);
       }
-      // Grab a new pivot and keep going!
-      pivot_and_score = determine_candidate(postings_lists);
-      pivot_list = std::get<0>(pivot_and_score);
-      potential_score = std::get<1>(pivot_and_score);
 
+      if (candidate && can_enter(doc_score)) {
+        if (heap_full)
+          score_heap.replace_top({doc_id, doc_score});
+        else
+          score_heap.push({doc_id, doc_score});
+        heap_full = score_heap.full();
+        if (heap_full) {
+          threshold = score_heap.top().score;
+          // lists that can no longer make the heap on their own
+          while (first_essential < num_lists &&
+                 !can_enter(max_prefix[first_essential+1]))
+            first_essential++;
+        }
+      }
     }
 
+    if (dyn_cache)
+      cache.insert(query_key(query), threshold);
+
+    stat.actual_threshold = threshold;
+
     // return the top-k results
-    res.list.resize(score_heap.size());
-    for (size_t i=0;i<res.list.size();i++) {
-      auto min = score_heap.top(); score_heap.pop();
-      res.list[res.list.size()-1-i] = min;
-    }
+    score_heap.sorted(res.list);
     return res;
   }
 
-
   result search(query_t& qry, const size_t k,
                 const index_form t_index_type,
                 const query_traversal t_index_traversal,
                 query_stat& stat) {
-
-    m_conjunctive_max = 0.0f; // Reset for new query
-    std::vector<plist_wrapper> pl_data(qry.tokens.size());
-    std::vector<plist_wrapper*> postings_lists;
+    // the heaps need room for one document at least
+    if (k == 0)
+      return result();
+
+    query_context& context = thread_context();
+    auto& pl_data = context.pl_data;
+    if (pl_data.size() < qry.tokens.size())
+      pl_data.resize(qry.tokens.size());
+    auto& postings_lists = context.postings_lists;
+    postings_lists.clear();
     size_t j=0;
     for (auto& qry_token : qry.tokens) {
-      pl_data[j] = plist_wrapper(m_postings_lists[qry_token.token_id]);
+      auto& pl = m_postings_lists[qry_token.token_id];
+      pl_data[j].reset(pl, ranker->term_weight(pl.size()));
+      if (context.in_batch)
+        pl_data[j].cur.set_block_cache(&context.batch_blocks);
       qry_token.df = pl_data[j].f_t;
       postings_lists.emplace_back(&(pl_data[j]));
-      m_conjunctive_max += pl_data[j].list_max_score;
       ++j;
     }
 
     if (t_index_traversal == OR) {
-      if (cache.find(qry.query_str) != cache.end()) {
+      if (cache.contains(query_key(qry))) {
         cache_hit++;
         stat.cache_hit = true;
         return result();
@@ -761,26 +1276,91 @@ public:
     }
 
     // Select and run query
-    // Disable conjunctive processing temporarily
+    if (t_index_traversal == OR && m_algorithm != PIVOT)
+      return process_maxscore(postings_lists, qry, k, stat,
+                              m_algorithm == BLOCK_MAXSCORE);
+
     if (t_index_type == BMW) {
-      if (t_index_traversal == OR)
-        return process_bmw_disjunctive(postings_lists, qry, k, stat);
-      // else if (t_index_traversal == AND)
-      //   return process_bmw_conjunctive(postings_lists,k);
+      if (t_index_traversal == AND)
+        return process_bmw_conjunctive(postings_lists, k, stat);
+      if (m_intra_threads > 1 &&
+          total_postings(postings_lists) >= m_parallel_min_postings)
+        return process_bmw_disjunctive_parallel(postings_lists, qry, k, stat);
+      return process_bmw_disjunctive(postings_lists, qry, k, stat);
     }
 
-    else if (t_index_type == WAND) {
-      if (t_index_traversal == OR)
-        return process_wand_disjunctive(postings_lists, qry, k, stat);
-      // else if (t_index_traversal == AND)
-      //   return process_wand_conjunctive(postings_lists,k);
+    if (t_index_type == WAND) {
+      if (t_index_traversal == AND)
+        return process_wand_conjunctive(postings_lists, k, stat);
+      return process_wand_disjunctive(postings_lists, qry, k, stat);
     }
 
-    else {
-      std::cerr << "Invalid run-type selected. Must be wand or bmw."
-                << std::endl;
-      exit(EXIT_FAILURE);
+    std::cerr << "Invalid run-type selected. Must be wand or bmw."
+              << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  // Runs a batch of queries on the calling thread, results, stats and
+  // times are in the order of queries. A block decoded by one query of the
+  // batch is read in place by the others, so queries touching the same
+  // blocks should run back to back. Queries are grouped by their longest
+  // list, which they share most blocks of, and within a group ordered by
+  // the middle docid of their shortest list: pruning skips the long list
+  // to the postings of the short ones, so queries whose short lists sit
+  // in the same docid range visit the same blocks of the long one. This
+  // pays off most on indexes reordered by URL or graph bisection, where
+  // the postings of a term cluster.
+  std::vector<result> search_batch(std::vector<query_t*>& queries,
+                                   const size_t k,
+                                   const index_form t_index_type,
+                                   const query_traversal t_index_traversal,
+                                   std::vector<query_stat>& stats,
+                                   std::vector<std::chrono::microseconds>& times) {
+    using clock = std::chrono::high_resolution_clock;
+    std::vector<std::vector<uint64_t>> keys(queries.size());
+    for (size_t q = 0; q < queries.size(); q++) {
+      auto& key = keys[q];
+      for (const auto& qry_token : queries[q]->tokens)
+        key.push_back(qry_token.token_id);
+      std::sort(key.begin(), key.end(),
+        [&](const uint64_t a, const uint64_t b) {
+          size_t a_size = m_postings_lists[a].size();
+          size_t b_size = m_postings_lists[b].size();
+          return a_size != b_size ? a_size > b_size : a < b;
+        });
+      if (key.size() > 1) {
+        const auto& shortest = m_postings_lists[key.back()];
+        uint64_t middle = shortest.num_blocks() == 0 ? 0
+                          : shortest.block_rep(shortest.num_blocks() / 2);
+        key.insert(key.begin() + 1, middle);
+      }
+    }
+    std::vector<size_t> order(queries.size());
+    for (size_t q = 0; q < order.size(); q++)
+      order[q] = q;
+    std::stable_sort(order.begin(), order.end(),
+      [&](const size_t a, const size_t b) { return keys[a] < keys[b]; });
+
+    query_context& context = thread_context();
+    context.batch_blocks.allocate(BATCH_CACHE_BLOCKS);
+    context.in_batch = true;
+    std::vector<result> results(queries.size());
+    stats.assign(queries.size(), query_stat());
+    times.assign(queries.size(), std::chrono::microseconds(0));
+    for (auto q : order) {
+      // a full cache decodes nothing more, it is emptied for the next
+      // queries
+      if (context.batch_blocks.full())
+        context.batch_blocks.clear();
+      auto qry_start = clock::now();
+      results[q] = search(*queries[q], k, t_index_type, t_index_traversal,
+                          stats[q]);
+      times[q] = std::chrono::duration_cast<std::chrono::microseconds>(
+          clock::now() - qry_start);
     }
+    context.batch_blocks.clear();
+    context.in_batch = false;
+    return results;
   }
 
 };
@@ -789,11 +1369,11 @@ public:
 template<class t_pl,class t_rank>
 void construct(idx_invfile<t_pl,t_rank> &idx,
                std::string& postings_file,
-                const double F)
+                const double F, const bool use_mmap = false)
 {
     using namespace sdsl;
     cout << "construct(idx_invfile)"<< endl;
-    idx = idx_invfile<t_pl,t_rank>(postings_file, F);
+    idx.load_postings(postings_file, F, use_mmap);
     cout << "Done" << endl;
 }
 #endif
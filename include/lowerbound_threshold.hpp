@@ -1,10 +1,21 @@
 #ifndef LOWERBOUND_THRESHOLD_HPP
 #define LOWERBOUND_THRESHOLD_HPP
 
-#include <unordered_map>
 #include "query.hpp"
+#include "score_cache.hpp"
 
-typedef std::unordered_map<std::string, double> cache_t;
+typedef score_cache cache_t;
+
+// Queries longer than this only use their first terms for the subsets
+const std::size_t MAX_SUBSET_TERMS = 64;
+
+// Cache key of a whole query, its tokens are sorted by term id
+inline uint64_t query_key(const query_t& query) {
+  uint64_t key = 0;
+  for (const auto& token : query.tokens)
+    key = add_term_to_key(key, token.token_id);
+  return key;
+}
 
 // Naive threshold, always return 0
 double naive_threshold(const query_t& query, const cache_t& cache);
@@ -0,0 +1,200 @@
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Alignment of the compressed postings payload inside the index file. QMX
+// decodes with aligned SSE loads, so mapped data has to start on a 16 byte
+// boundary (the mapping itself is page aligned).
+const uint64_t MAPPED_ALIGNMENT = 16;
+
+// Zero padding up to the next aligned file offset
+inline uint64_t write_padding(std::ostream& out,
+                              const uint64_t alignment = MAPPED_ALIGNMENT) {
+  static const char zeros[64] = {0};
+  uint64_t pos = out.tellp();
+  uint64_t pad = (alignment - (pos % alignment)) % alignment;
+  out.write(zeros, pad);
+  return pad;
+}
+
+inline void skip_padding(std::istream& in,
+                         const uint64_t alignment = MAPPED_ALIGNMENT) {
+  uint64_t pos = in.tellg();
+  in.seekg((alignment - (pos % alignment)) % alignment, std::ios::cur);
+}
+
+inline const char* skip_padding(const char* ptr,
+                                const uint64_t alignment = MAPPED_ALIGNMENT) {
+  uintptr_t pos = reinterpret_cast<uintptr_t>(ptr);
+  return ptr + (alignment - (pos % alignment)) % alignment;
+}
+
+// Reads a trivially copyable member from mapped memory and advances ptr
+template<class T>
+inline void read_mapped(T& t, const char*& ptr) {
+  std::memcpy(&t, ptr, sizeof(T));
+  ptr += sizeof(T);
+}
+
+// Read-only, shared mapping of a whole file. Pages stay in the page cache
+// and are shared by every process mapping the same index.
+class mapped_file {
+private:
+  const char* m_data = nullptr;
+  uint64_t m_size = 0;
+public:
+  mapped_file() = default;
+  mapped_file(const mapped_file&) = delete;
+  mapped_file& operator=(const mapped_file&) = delete;
+
+  mapped_file(mapped_file&& mf) {
+    *this = std::move(mf);
+  }
+
+  mapped_file& operator=(mapped_file&& mf) {
+    if (this != &mf) {
+      unmap();
+      m_data = mf.m_data;
+      m_size = mf.m_size;
+      mf.m_data = nullptr;
+      mf.m_size = 0;
+    }
+    return *this;
+  }
+
+  explicit mapped_file(const std::string& file_name) {
+    int fd = open(file_name.c_str(), O_RDONLY);
+    if (fd == -1) {
+      std::cerr << "Could not open file: " << file_name << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    struct stat sb;
+    if (fstat(fd, &sb) == -1) {
+      perror("could not stat mapped file");
+      exit(EXIT_FAILURE);
+    }
+    m_size = sb.st_size;
+    void* addr = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+      perror("could not mmap file");
+      exit(EXIT_FAILURE);
+    }
+    m_data = static_cast<const char*>(addr);
+  }
+
+  ~mapped_file() {
+    unmap();
+  }
+
+  const char* data() const { return m_data; }
+  uint64_t size() const { return m_size; }
+
+private:
+  void unmap() {
+    if (m_data != nullptr) {
+      munmap(const_cast<char*>(m_data), m_size);
+      m_data = nullptr;
+      m_size = 0;
+    }
+  }
+};
+
+// Array which either owns its elements or is a view over mapped memory.
+// Lists loaded from a stream own their data; lists created over a
+// mapped_file only point into it and never copy.
+template<class t_value, class t_alloc = std::allocator<t_value>>
+class mappable_vector {
+public:
+  using value_type = t_value;
+  using size_type = size_t;
+  using owned_type = std::vector<t_value, t_alloc>;
+private:
+  owned_type m_owned;
+  const t_value* m_data = nullptr;
+  size_type m_size = 0;
+  bool m_mapped = false;
+public:
+  mappable_vector() = default;
+
+  mappable_vector(mappable_vector&& mv) {
+    *this = std::move(mv);
+  }
+
+  mappable_vector& operator=(mappable_vector&& mv) {
+    if (this != &mv) {
+      m_owned = std::move(mv.m_owned);
+      m_mapped = mv.m_mapped;
+      if (m_mapped) {
+        m_data = mv.m_data;
+        m_size = mv.m_size;
+      } else {
+        bind();
+      }
+      mv.m_owned.clear();
+      mv.m_mapped = false;
+      mv.bind();
+    }
+    return *this;
+  }
+
+  mappable_vector(const mappable_vector& mv) : m_owned(mv.m_owned),
+      m_data(mv.m_data), m_size(mv.m_size), m_mapped(mv.m_mapped) {
+    if (!m_mapped) bind();
+  }
+
+  mappable_vector& operator=(const mappable_vector& mv) {
+    if (this != &mv) {
+      m_owned = mv.m_owned;
+      m_data = mv.m_data;
+      m_size = mv.m_size;
+      m_mapped = mv.m_mapped;
+      if (!m_mapped) bind();
+    }
+    return *this;
+  }
+
+  mappable_vector(owned_type&& v) : m_owned(std::move(v)) {
+    bind();
+  }
+
+  void resize(size_type n) {
+    m_owned.resize(n);
+    m_mapped = false;
+    bind();
+  }
+
+  void map(const t_value* data, size_type n) {
+    owned_type().swap(m_owned);
+    m_data = data;
+    m_size = n;
+    m_mapped = true;
+  }
+
+  const t_value* data() const { return m_data; }
+  // Writable storage, only valid for owned data (used while loading)
+  t_value* data() { return m_owned.data(); }
+  size_type size() const { return m_size; }
+  bool empty() const { return m_size == 0; }
+  const t_value& operator[](size_type i) const { return m_data[i]; }
+  const t_value* begin() const { return m_data; }
+  const t_value* end() const { return m_data + m_size; }
+
+private:
+  void bind() {
+    m_data = m_owned.data();
+    m_size = m_owned.size();
+  }
+};
+
+#endif
@@ -8,8 +8,7 @@
 #include <unordered_map>
 #include <algorithm>
 
-
-const std::string DICT_FILENAME = "dict.txt";
+#include "index_metadata.hpp"
 
 struct doc_score {
 	uint64_t doc_id;
@@ -78,37 +77,16 @@ struct query_t {
 
 struct query_parser {
     query_parser() = delete;
-    using mapping_t = std::pair<std::unordered_map<std::string,uint64_t>,
-                     std::unordered_map<uint64_t,std::string>
-                     >;
+    using mapping_t = term_dictionary;
 
     static mapping_t
          load_dictionary(const std::string& collection_dir)
     {
-        std::unordered_map<std::string,uint64_t> id_mapping;
-        std::unordered_map<uint64_t,std::string> reverse_id_mapping;
-        {
-            auto dict_file = collection_dir + "/" + DICT_FILENAME;
-            std::ifstream dfs(dict_file);
-            if(!dfs.is_open()) {
-                std::cerr << "cannot load dictionary file.";
-                exit(EXIT_FAILURE);
-            }
-            std::string term_mapping;
-            while( std::getline(dfs,term_mapping) ) {
-                auto sep_pos = term_mapping.find(' ');
-                auto term = term_mapping.substr(0,sep_pos);
-                auto idstr = term_mapping.substr(sep_pos+1);
-                uint64_t id = std::stoull(idstr);
-                id_mapping[term] = id;
-                reverse_id_mapping[id] = term;
-            }
-        }
-        return {id_mapping,reverse_id_mapping};
+        return term_dictionary::load(collection_dir);
     }
 
     static std::tuple<bool,uint64_t,std::vector<uint64_t>>
-        map_to_ids(const std::unordered_map<std::string,uint64_t>& id_mapping,
+        map_to_ids(const mapping_t& id_mapping,
                    std::string query_str,bool only_complete,bool integers)
     {
         auto id_sep_pos = query_str.find(';');
@@ -123,9 +101,9 @@ struct query_parser {
                 uint64_t id = std::stoull(qry_token);
                 ids.push_back(id);
             } else {
-                auto id_itr = id_mapping.find(qry_token);
-                if(id_itr != id_mapping.end()) {
-                    ids.push_back(id_itr->second);
+                uint64_t id;
+                if(id_mapping.find(qry_token, id)) {
+                    ids.push_back(id);
                 } else {
                     std::cerr << "ERROR: could not find '"
                               << qry_token << "' in the dictionary."
@@ -160,10 +138,7 @@ struct query_parser {
                 bool only_complete = false,bool integers = false)
     {
 
-        const auto& id_mapping = mapping.first;
-        const auto& reverse_mapping = mapping.second;
-
-        auto mapped_qry = map_to_ids(id_mapping,query_str,only_complete,integers);
+        auto mapped_qry = map_to_ids(mapping,query_str,only_complete,integers);
 
         bool parse_ok = std::get<0>(mapped_qry);
         auto qry_id = std::get<1>(mapped_qry);
@@ -178,11 +153,7 @@ struct query_parser {
             size_t index = 0;
             for(const auto& qry_tok : qry_set) {
                 uint64_t term = qry_tok.first;
-                auto rmitr = reverse_mapping.find(term);
-                std::string term_str;
-                if(rmitr != reverse_mapping.end()) {
-                    term_str = rmitr->second;
-                }
+                std::string term_str = mapping.term(term);
                 query_tokens.emplace_back(term,term_str,qry_tok.second);
                 ++index;
             }
@@ -200,10 +171,16 @@ struct query_parser {
     static std::vector<query_t> parse_queries(const std::string& collection_dir,
                                               const std::string& query_file,
                                               bool only_complete = false) {
-        std::vector<query_t> queries;
-
         /* load the mapping */
         auto mapping = load_dictionary(collection_dir);
+        return parse_queries(mapping, query_file, only_complete);
+    }
+
+    static std::vector<query_t> parse_queries(const mapping_t& mapping,
+                                              const std::string& query_file,
+                                              bool only_complete = false) {
+        std::vector<query_t> queries;
+
         /* parse queries */
         std::ifstream qfs(query_file);
         if(!qfs.is_open()) {
@@ -0,0 +1,249 @@
+#ifndef SAAT_INVIDX_HPP
+#define SAAT_INVIDX_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "query.hpp"
+#include "impact_postings_list.hpp"
+#include "mapped_file.hpp"
+#include "util.hpp"
+#include "topk_queue.hpp"
+
+// Score-at-a-time index over impact ordered lists. A query walks the
+// segments of all its terms by decreasing impact and adds each impact to
+// the accumulators of the segment's docids. Processing can stop after a
+// budget of postings, the top-k of the accumulators so far is the answer
+// (anytime ranking). Without a budget every posting is processed and the
+// result equals exhaustive disjunctive ranking.
+class idx_saat {
+public:
+  using size_type = sdsl::int_vector<>::size_type;
+  using plist_type = impact_postings_list;
+  // Accumulators are cleared a page at a time, on first use in a query
+  static const size_t ACCUMULATOR_PAGE_BITS = 12;
+
+private:
+  // Per thread accumulators, reused across queries
+  struct accumulator_table {
+    std::vector<uint32_t> scores;
+    std::vector<uint8_t> dirty; // page was touched in this query
+    std::vector<uint32_t> dirty_pages;
+
+    void reset(const size_t num_docs) {
+      size_t num_pages = (num_docs >> ACCUMULATOR_PAGE_BITS) + 1;
+      if (scores.size() != num_pages << ACCUMULATOR_PAGE_BITS) {
+        scores.assign(num_pages << ACCUMULATOR_PAGE_BITS, 0);
+        dirty.assign(num_pages, 0);
+        dirty_pages.clear();
+      }
+      for (auto page : dirty_pages)
+        dirty[page] = 0;
+      dirty_pages.clear();
+    }
+
+    void add(const uint32_t doc_id, const uint32_t impact) {
+      uint32_t page = doc_id >> ACCUMULATOR_PAGE_BITS;
+      if (!dirty[page]) {
+        dirty[page] = 1;
+        dirty_pages.push_back(page);
+        std::fill_n(scores.begin() + ((size_t)page << ACCUMULATOR_PAGE_BITS),
+                    (size_t)1 << ACCUMULATOR_PAGE_BITS, 0);
+      }
+      scores[doc_id] += impact;
+    }
+  };
+
+  struct segment_ref {
+    uint32_t impact;
+    uint32_t list;    // position of the list in the query
+    uint32_t segment;
+  };
+
+  std::vector<plist_type> m_postings_lists;
+  mapped_file m_postings_map; // only used when the lists are mapped
+  uint64_t m_num_docs = 0;
+  uint64_t m_postings_budget = 0; // 0 processes every posting
+
+public:
+  idx_saat() = default;
+  idx_saat(const idx_saat&) = delete;
+  idx_saat& operator=(const idx_saat&) = delete;
+
+  void load_postings(std::string& postings_file, const double,
+                     const bool use_mmap = false) {
+    if (use_mmap) {
+      map_postings(postings_file);
+      return;
+    }
+    std::ifstream ifs(postings_file);
+    if (ifs.is_open() != true){
+      std::cerr << "Could not open file: " <<  postings_file << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    size_t num_lists;
+    sdsl::read_member(num_lists,ifs);
+    m_postings_lists.resize(num_lists);
+    for (size_t i=0;i<num_lists;i++) {
+      m_postings_lists[i].load(ifs);
+    }
+  }
+
+  // Maps the postings file, lists are located through the directory
+  // written next to it by build_index
+  void map_postings(const std::string& postings_file) {
+    m_postings_map = mapped_file(postings_file);
+    const char* ptr = m_postings_map.data();
+    size_t num_lists;
+    read_mapped(num_lists, ptr);
+    m_postings_lists.resize(num_lists);
+
+    std::string dir_file = postings_file.substr(0, postings_file.rfind('.'))
+                           + ".dir";
+    if (file_exists(dir_file)) {
+      mapped_file directory(dir_file);
+      const char* dir_ptr = directory.data();
+      size_t num_offsets;
+      read_mapped(num_offsets, dir_ptr);
+      if (num_offsets != num_lists) {
+        std::cerr << "Postings directory does not match " << postings_file
+                  << ". Please rebuild." << std::endl;
+        exit(EXIT_FAILURE);
+      }
+      const uint64_t* offsets = (const uint64_t*)dir_ptr;
+      for (size_t i=0;i<num_lists;i++) {
+        m_postings_lists[i].map(m_postings_map.data() + offsets[i]);
+      }
+    } else {
+      std::cerr << "No postings directory found, walking list headers."
+                << std::endl;
+      for (size_t i=0;i<num_lists;i++) {
+        ptr = m_postings_lists[i].map(ptr);
+      }
+    }
+  }
+
+  // Impacts need no ranker, only the number of documents
+  void load(std::vector<uint64_t> doc_len, uint64_t, uint64_t num_docs) {
+    m_num_docs = std::max<uint64_t>(num_docs, doc_len.size());
+  }
+
+  // Postings processed per query before it stops, 0 for no limit
+  void set_postings_budget(const uint64_t budget) {
+    m_postings_budget = budget;
+  }
+
+  // The score cache, threshold estimation and query algorithms only apply
+  // to WAND and BMW
+  void set_dyn_cache(bool) {}
+  void set_query_algorithm(const query_algorithm) {}
+  void set_cache_budget(size_t) {}
+  void set_threshold_method(const std::string&) {}
+  void set_intra_query_threads(const size_t) {}
+  void reset_cache() {}
+  template<class t_dict>
+  void load_cache(const std::string&, const t_dict&) {}
+  template<class t_dict>
+  void load_term_cache(const std::string&, const t_dict&) {}
+  double hit_rate() { return 0; }
+  double subset_found_rate() { return 0; }
+
+  result search(query_t& qry, const size_t k, const index_form,
+                const query_traversal t_index_traversal, query_stat& stat) {
+    if (t_index_traversal != OR) {
+      std::cerr << "SAAT indexes only support OR traversal." << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    if (k == 0)
+      return result();
+
+    result res;
+    std::vector<const plist_type*> lists;
+    std::vector<segment_ref> segments;
+    for (auto& qry_token : qry.tokens) {
+      const plist_type& pl = m_postings_lists[qry_token.token_id];
+      qry_token.df = pl.size();
+      res.postings_total += pl.size();
+      uint32_t list = lists.size();
+      lists.push_back(&pl);
+      for (uint32_t s = 0; s < pl.num_segments(); s++) {
+        segments.push_back({pl.segment_at(s).impact, list, s});
+      }
+    }
+    // highest impacts first, they change the ranking the most
+    std::stable_sort(segments.begin(), segments.end(),
+      [](const segment_ref& a, const segment_ref& b) {
+        return a.impact > b.impact;
+      });
+
+    static thread_local accumulator_table accumulators;
+    static thread_local plist_type::data_type ids;
+    accumulators.reset(m_num_docs);
+
+    uint64_t budget = m_postings_budget ? m_postings_budget
+                                        : std::numeric_limits<uint64_t>::max();
+    for (const auto& ref : segments) {
+      if (res.postings_evaluated >= budget)
+        break;
+      const plist_type& pl = *lists[ref.list];
+      pl.decompress_segment(ref.segment, ids);
+      uint64_t count = std::min<uint64_t>(pl.segment_at(ref.segment).count,
+                                          budget - res.postings_evaluated);
+      for (uint64_t i = 0; i < count; i++) {
+        accumulators.add(ids[i], ref.impact);
+      }
+      res.postings_evaluated += count;
+    }
+
+    // top-k over the pages touched by the query
+    static thread_local topk_queue heap;
+    heap.reset(k);
+    for (auto page : accumulators.dirty_pages) {
+      uint64_t first = (uint64_t)page << ACCUMULATOR_PAGE_BITS;
+      uint64_t last = std::min<uint64_t>(first + (1 << ACCUMULATOR_PAGE_BITS),
+                                         m_num_docs);
+      for (uint64_t d = first; d < last; d++) {
+        uint32_t score = accumulators.scores[d];
+        if (score == 0)
+          continue;
+        res.docs_fully_evaluated++;
+        if (heap.size() < k) {
+          heap.push({d, (double)score});
+          res.docs_added_to_heap++;
+        } else if (doc_score(d, score) > heap.top()) {
+          heap.replace_top({d, (double)score});
+          res.docs_added_to_heap++;
+        }
+      }
+    }
+
+    heap.sorted(res.list);
+    res.final_threshold = res.list.size() == k ? res.list.back().score : 0;
+    stat.actual_threshold = res.final_threshold;
+    return res;
+  }
+
+  // SAAT queries decode every segment they touch once into accumulators,
+  // so queries share no decoded blocks and batches are not supported
+  std::vector<result> search_batch(std::vector<query_t*>&, const size_t,
+                                   const index_form, const query_traversal,
+                                   std::vector<query_stat>&,
+                                   std::vector<std::chrono::microseconds>&) {
+    std::cerr << "SAAT indexes do not run query batches." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+};
+
+inline void construct(idx_saat& idx, std::string& postings_file,
+                      const double F, const bool use_mmap = false)
+{
+  std::cout << "construct(idx_saat)" << std::endl;
+  idx.load_postings(postings_file, F, use_mmap);
+  std::cout << "Done" << std::endl;
+}
+
+#endif // SAAT_INVIDX_HPP
@@ -0,0 +1,224 @@
+#ifndef SCORE_CACHE_HPP
+#define SCORE_CACHE_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+// Mixes the next term id into the key of a term subset (splitmix64)
+inline uint64_t add_term_to_key(const uint64_t key, const uint64_t term_id) {
+  uint64_t z = key + term_id + 0x9e3779b97f4a7c15ULL;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+// Key of a term subset, the term ids have to be sorted ascending
+inline uint64_t subset_key(const uint64_t* term_ids, const size_t n) {
+  uint64_t key = 0;
+  for (size_t i = 0; i < n; i++)
+    key = add_term_to_key(key, term_ids[i]);
+  return key;
+}
+
+// Bounded score cache which query threads read and update concurrently
+// without a lock. Entries are keyed on the 64 bit subset_key of their
+// sorted term ids (never compared term by term) and the table is split into
+// small buckets of BUCKET_SLOTS entries; a key lives in one bucket and a
+// full bucket evicts with CLOCK, a hit gives an entry a second chance.
+// Entries loaded from a cache file are pinned and never evicted.
+//
+// Every slot holds its key and its score in separate atomics. Writers
+// park the key on BUSY while the score changes and readers re-check the
+// key after reading the score, so a reader never pairs a key with
+// another key's score.
+class score_cache {
+public:
+  static const size_t BUCKET_SLOTS = 8;
+  // Memory budget of the dynamic cache unless told otherwise
+  static const size_t DEFAULT_BUDGET = 64 << 20;
+
+private:
+  static const uint64_t EMPTY = 0;
+  static const uint64_t BUSY = 1;
+
+  struct slot {
+    std::atomic<uint64_t> key;
+    std::atomic<uint64_t> score; // bits of the double
+  };
+
+  struct bucket {
+    slot slots[BUCKET_SLOTS];
+    std::atomic<uint8_t> referenced; // CLOCK bit of every slot
+    std::atomic<uint8_t> pinned;     // slots CLOCK passes over
+    std::atomic<uint8_t> hand;
+  };
+
+  std::unique_ptr<bucket[]> m_buckets;
+  size_t m_bucket_mask = 0;
+
+  // keep clear of the reserved key values
+  static uint64_t slot_key(const uint64_t key) {
+    return key > BUSY ? key : key + BUSY + 1;
+  }
+
+  static uint64_t to_bits(const double score) {
+    uint64_t bits;
+    std::memcpy(&bits, &score, sizeof(bits));
+    return bits;
+  }
+
+  static double from_bits(const uint64_t bits) {
+    double score;
+    std::memcpy(&score, &bits, sizeof(score));
+    return score;
+  }
+
+  bucket& bucket_of(const uint64_t h) const {
+    // the low bits pick the bucket, mix in the high ones
+    return m_buckets[(h ^ (h >> 32)) & m_bucket_mask];
+  }
+
+  // Claims slot i of b if it holds expected, stores h with the score.
+  // Stored entries start out referenced.
+  static bool claim(bucket& b, const size_t i, uint64_t expected,
+                    const uint64_t h, const double score, const bool pin) {
+    slot& s = b.slots[i];
+    if (!s.key.compare_exchange_strong(expected, BUSY))
+      return false;
+    if (pin)
+      b.pinned.fetch_or(1 << i);
+    s.score.store(to_bits(score));
+    s.key.store(h);
+    b.referenced.fetch_or(1 << i);
+    return true;
+  }
+
+public:
+  // An empty cache holds nothing until resized
+  score_cache() = default;
+
+  explicit score_cache(const size_t budget_bytes) {
+    resize(budget_bytes);
+  }
+
+  score_cache(const score_cache&) = delete;
+  score_cache& operator=(const score_cache&) = delete;
+
+  // Drops every entry and sizes the table to fit budget_bytes. Not safe
+  // while other threads use the cache.
+  void resize(const size_t budget_bytes) {
+    size_t num_buckets = 1;
+    while (num_buckets * 2 * sizeof(bucket) <= budget_bytes)
+      num_buckets *= 2;
+    m_buckets.reset(new bucket[num_buckets]);
+    m_bucket_mask = num_buckets - 1;
+    clear();
+  }
+
+  // Not safe while other threads use the cache
+  void clear() {
+    if (!m_buckets)
+      return;
+    for (size_t b = 0; b <= m_bucket_mask; b++) {
+      for (auto& s : m_buckets[b].slots) {
+        s.key.store(EMPTY);
+        s.score.store(0);
+      }
+      m_buckets[b].referenced.store(0);
+      m_buckets[b].pinned.store(0);
+      m_buckets[b].hand.store(0);
+    }
+  }
+
+  // Budget which holds entries with few bucket overflows
+  static size_t budget_for(const size_t entries) {
+    return (4 * entries / BUCKET_SLOTS + 1) * sizeof(bucket);
+  }
+
+  size_t budget() const {
+    return m_buckets ? (m_bucket_mask + 1) * sizeof(bucket) : 0;
+  }
+
+  size_t capacity() const {
+    return m_buckets ? (m_bucket_mask + 1) * BUCKET_SLOTS : 0;
+  }
+
+  // Looks up key, returns whether it was found and its score if so
+  bool find(const uint64_t key, double& score) const {
+    if (!m_buckets)
+      return false;
+    uint64_t h = slot_key(key);
+    bucket& b = bucket_of(h);
+    for (size_t i = 0; i < BUCKET_SLOTS; i++) {
+      slot& s = b.slots[i];
+      if (s.key.load() != h)
+        continue;
+      uint64_t bits = s.score.load();
+      if (s.key.load() != h)
+        return false; // replaced while reading
+      if (!(b.referenced.load() & (1 << i)))
+        b.referenced.fetch_or(1 << i);
+      score = from_bits(bits);
+      return true;
+    }
+    return false;
+  }
+
+  bool contains(const uint64_t key) const {
+    double score;
+    return find(key, score);
+  }
+
+  // Stores the score of key, evicting another entry of its bucket if full.
+  // Fails when the cache is empty or every slot of the bucket is pinned.
+  // A pinned entry is never evicted; pinning is not safe while other
+  // threads insert.
+  bool insert(const uint64_t key, const double score, const bool pin = false) {
+    if (!m_buckets)
+      return false;
+    uint64_t h = slot_key(key);
+    bucket& b = bucket_of(h);
+    while (true) {
+      // update in place if present, remember a free slot otherwise
+      size_t free_slot = BUCKET_SLOTS;
+      bool raced = false;
+      for (size_t i = 0; i < BUCKET_SLOTS; i++) {
+        uint64_t cur = b.slots[i].key.load();
+        if (cur == h) {
+          if (claim(b, i, h, h, score, pin))
+            return true;
+          raced = true; // another writer got there first, start over
+          break;
+        }
+        if (cur == EMPTY && free_slot == BUCKET_SLOTS)
+          free_slot = i;
+      }
+      if (raced)
+        continue;
+      if (free_slot != BUCKET_SLOTS) {
+        if (claim(b, free_slot, EMPTY, h, score, pin))
+          return true;
+        continue;
+      }
+      if (b.pinned.load() == (uint8_t)((1 << BUCKET_SLOTS) - 1))
+        return false;
+
+      // CLOCK: clear referenced bits until an unreferenced victim shows up
+      for (size_t tries = 0; tries < 2 * BUCKET_SLOTS; tries++) {
+        size_t i = b.hand.fetch_add(1) % BUCKET_SLOTS;
+        uint8_t bit = 1 << i;
+        if (b.pinned.load() & bit)
+          continue;
+        if (b.referenced.fetch_and((uint8_t)~bit) & bit)
+          continue;
+        uint64_t victim = b.slots[i].key.load();
+        if (victim > BUSY && claim(b, i, victim, h, score, pin))
+          return true;
+      }
+    }
+  }
+};
+
+#endif // SCORE_CACHE_HPP
@@ -0,0 +1,98 @@
+#ifndef TOPK_QUEUE_HPP
+#define TOPK_QUEUE_HPP
+
+#include <algorithm>
+#include <cassert>
+#include <functional>
+#include <vector>
+
+#include "query.hpp"
+
+// Fixed capacity min-heap of the k best documents of a query. The heap
+// is 4-ary, so a sift-down touches one cache line of children per level
+// and is half as deep as a binary heap, which matters for k=1000. The
+// worst document (the threshold) always sits in the first slot. reset()
+// keeps the storage, so a queue reused across queries never allocates
+// once it has grown to the largest k.
+class topk_queue {
+public:
+  static const size_t ARITY = 4;
+
+private:
+  std::vector<doc_score> m_heap;
+  size_t m_size = 0;
+  size_t m_k = 0;
+
+public:
+  topk_queue() = default;
+  explicit topk_queue(const size_t k) {
+    reset(k);
+  }
+
+  // Empties the queue for a query retrieving k > 0 documents
+  void reset(const size_t k) {
+    assert(k > 0);
+    m_k = k;
+    m_size = 0;
+    if (m_heap.size() < k)
+      m_heap.resize(k);
+  }
+
+  size_t size() const { return m_size; }
+  bool empty() const { return m_size == 0; }
+  bool full() const { return m_size == m_k; }
+
+  // The worst document kept, only valid when not empty
+  const doc_score& top() const { return m_heap[0]; }
+
+  // Adds a document, the queue must not be full
+  void push(const doc_score& entry) {
+    size_t pos = m_size++;
+    while (pos > 0) {
+      size_t parent = (pos - 1) / ARITY;
+      if (!(m_heap[parent] > entry))
+        break;
+      m_heap[pos] = m_heap[parent];
+      pos = parent;
+    }
+    m_heap[pos] = entry;
+  }
+
+  // Replaces the worst document, one sift-down instead of pop and push
+  void replace_top(const doc_score& entry) {
+    sift_down(0, entry);
+  }
+
+  void pop() {
+    if (--m_size > 0)
+      sift_down(0, m_heap[m_size]);
+  }
+
+  // The kept documents, best first
+  void sorted(std::vector<doc_score>& out) const {
+    out.assign(m_heap.begin(), m_heap.begin() + m_size);
+    std::sort(out.begin(), out.end(), std::greater<doc_score>());
+  }
+
+private:
+  void sift_down(size_t pos, const doc_score entry) {
+    while (true) {
+      size_t first = pos * ARITY + 1;
+      if (first >= m_size)
+        break;
+      size_t last = std::min(first + ARITY, m_size);
+      size_t min_child = first;
+      for (size_t c = first + 1; c < last; c++) {
+        if (m_heap[min_child] > m_heap[c])
+          min_child = c;
+      }
+      if (!(entry > m_heap[min_child]))
+        break;
+      m_heap[pos] = m_heap[min_child];
+      pos = min_child;
+    }
+    m_heap[pos] = entry;
+  }
+};
+
+#endif // TOPK_QUEUE_HPP
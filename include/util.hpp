@@ -22,7 +22,17 @@ enum postings_form {
 
 enum index_form {
   WAND,
-  BMW
+  BMW,
+  SAAT
+};
+
+// Codec of the postings blocks
+enum postings_codec {
+  QMX,
+  QMX_D4,
+  SIMD_BP128,
+  SIMD_FASTPFOR,
+  VBYTE
 };
 
 enum query_traversal {
@@ -31,15 +41,41 @@ enum query_traversal {
   UNKNOWN
 };
 
+// Disjunctive query processing algorithm of WAND and BMW indexes
+enum query_algorithm {
+  PIVOT,          // WAND or BMW pivoting, following the index type
+  MAXSCORE,       // MaxScore over the list maximums
+  BLOCK_MAXSCORE  // MaxScore refined with block maximums, BMW only
+};
+
 
 char *ATIRE_DOCUMENT_FILE_START = "~documentfilenamesstart";
 char *ATIRE_DOCUMENT_FILE_END = "~documentfilenamesfinish";
 const std::string STRING_WAND = "WAND";
 const std::string STRING_BMW = "BMW";
+const std::string STRING_SAAT = "SAAT";
+const std::string STRING_PIVOT = "PIVOT";
+const std::string STRING_MAXSCORE = "MAXSCORE";
+const std::string STRING_BLOCK_MAXSCORE = "BMM";
 // const std::string DICT_FILENAME = "dict.txt";
 const std::string DOCNAMES_FILENAME = "doc_names.txt";
 const std::string STRING_FREQ = "FREQUENCY";
 const std::string STRING_QUANT = "QUANTIZED";
+// Indexed by postings_codec
+const std::vector<std::string> STRING_CODECS = {
+  "QMX", "QMX_D4", "SIMD_BP128", "SIMD_FASTPFOR", "VBYTE"
+};
+
+// Looks up the codec called name, returns false if there is none
+inline bool codec_from_string(const std::string& name, postings_codec& codec) {
+  for (size_t i = 0; i < STRING_CODECS.size(); i++) {
+    if (STRING_CODECS[i] == name) {
+      codec = (postings_codec)i;
+      return true;
+    }
+  }
+  return false;
+}
 
 // Knuth trick for comparing floating numbers
 // check if a and b are equal with respect to the defined tolerance epsilon
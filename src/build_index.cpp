@@ -1,4 +1,11 @@
 #include <iostream>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
 
 #include "ant_param_block.h"
 #include "search_engine.h"
@@ -12,10 +19,368 @@
 
 #include "sdsl/int_vector_buffer.hpp"
 #include "include/block_postings_list.hpp"
+#include "include/impact_postings_list.hpp"
 #include "include/util.hpp"
+#include "include/index_metadata.hpp"
+#include "include/docid_reordering.hpp"
 
-const static size_t INIT_SZ = 4096; 
 const static size_t INDRI_OFFSET = 2; // Indri offsets terms 0 and 1 as special
+// A batch is closed once it holds this many terms or postings
+const static size_t BATCH_TERMS = 1024;
+const static size_t BATCH_POSTINGS = 1 << 20;
+// Batches in flight per compression thread
+const static size_t BATCHES_PER_THREAD = 2;
+
+// Appends a compressed list to the postings file. Lists are serialized by
+// the writer, their padding depends on where they land in the file.
+using list_writer = std::function<void(std::ostream&)>;
+
+// Postings of a term as ATIRE stores them: segments of equal impact,
+// highest impact first, each holding ascending docids
+struct impact_segments {
+  std::vector<uint32_t> docids;
+  std::vector<uint32_t> impacts; // impact of each segment
+  std::vector<uint32_t> ends;    // end of each segment in docids
+};
+
+// Merges the segments of a term into docid order with a loser tree, each
+// posting costs log2 of the number of segments comparisons. A docid is in
+// one segment only, so there are no ties. ids and freqs are sized to the
+// number of postings.
+void merge_segments(const impact_segments& term, sdsl::int_vector<32>& ids,
+                    sdsl::int_vector<32>& freqs)
+{
+  const size_t num_segments = term.impacts.size();
+  std::vector<uint32_t> pos(num_segments), end(num_segments);
+  for (size_t s = 0; s < num_segments; s++) {
+    pos[s] = s == 0 ? 0 : term.ends[s-1];
+    end[s] = term.ends[s];
+  }
+  // finished segments and the padding leaves sort last
+  auto key = [&](const size_t s) -> uint64_t {
+    return s < num_segments && pos[s] < end[s] ? term.docids[pos[s]]
+                                               : UINT64_MAX;
+  };
+
+  size_t leaves = 1;
+  while (leaves < num_segments)
+    leaves <<= 1;
+  // internal nodes keep the loser of their match, the winner moves up
+  std::vector<uint32_t> losers(leaves);
+  std::vector<uint32_t> winners(2 * leaves);
+  for (size_t l = 0; l < leaves; l++)
+    winners[leaves + l] = l;
+  for (size_t node = leaves - 1; node > 0; node--) {
+    uint32_t a = winners[2 * node], b = winners[2 * node + 1];
+    bool a_wins = key(a) < key(b);
+    winners[node] = a_wins ? a : b;
+    losers[node] = a_wins ? b : a;
+  }
+  uint32_t winner = winners[1];
+
+  for (size_t i = 0; i < ids.size(); i++) {
+    ids[i] = term.docids[pos[winner]];
+    freqs[i] = term.impacts[winner];
+    pos[winner]++;
+    // replay the matches on the path of the winner's leaf
+    uint64_t winner_key = key(winner);
+    for (size_t node = (leaves + winner) / 2; node > 0; node /= 2) {
+      uint64_t loser_key = key(losers[node]);
+      if (loser_key < winner_key) {
+        std::swap(losers[node], winner);
+        winner_key = loser_key;
+      }
+    }
+  }
+}
+
+// Gives the postings of a term their docids in the new document order,
+// keeping every segment sorted by docid
+void renumber_segments(impact_segments& term,
+                       const std::vector<uint32_t>& new_docids)
+{
+  for (auto& docid : term.docids)
+    docid = new_docids[docid];
+  for (size_t s = 0; s < term.ends.size(); s++) {
+    auto first = term.docids.begin() + (s == 0 ? 0 : term.ends[s-1]);
+    std::sort(first, term.docids.begin() + term.ends[s]);
+  }
+}
+
+// Decodes the impact ordered postings of ATIRE B-tree terms
+class atire_postings_reader {
+private:
+  ANT_search_engine& m_engine;
+  ANT_compression_factory m_factory;
+  ANT_compressable_integer* m_impact_header;
+  ANT_compressable_integer* m_raw;
+  unsigned char* m_postings_buffer;
+
+public:
+  explicit atire_postings_reader(ANT_search_engine& engine)
+    : m_engine(engine) {
+    long long impact_header_size = ANT_impact_header::NUM_OF_QUANTUMS * sizeof(ANT_compressable_integer) * 3;
+    auto postings_list_size = engine.get_postings_buffer_length();
+    auto raw_list_size = sizeof(*m_raw) * (engine.document_count() + ANT_COMPRESSION_FACTORY_END_PADDING);
+    m_impact_header = (ANT_compressable_integer *)malloc(impact_header_size);
+    m_postings_buffer = (unsigned char *)malloc((size_t)postings_list_size);
+    m_raw = (ANT_compressable_integer *)malloc((size_t)raw_list_size);
+  }
+  atire_postings_reader(const atire_postings_reader&) = delete;
+  atire_postings_reader& operator=(const atire_postings_reader&) = delete;
+
+  ~atire_postings_reader() {
+    free(m_impact_header);
+    free(m_postings_buffer);
+    free(m_raw);
+  }
+
+  // Replaces segments with the postings of the term leaf describes
+  void read(ANT_search_engine_btree_leaf& leaf, impact_segments& segments) {
+    unsigned char *postings_list = m_engine.get_postings(&leaf, m_postings_buffer);
+
+    auto the_quantum_count = ANT_impact_header::get_quantum_count(postings_list);
+    auto beginning_of_the_postings = ANT_impact_header::get_beginning_of_the_postings(postings_list);
+    m_factory.decompress(m_impact_header, postings_list + ANT_impact_header::INFO_SIZE, the_quantum_count * 3);
+
+    long long docid;
+    ANT_compressable_integer *current, *end;
+    ANT_compressable_integer *impact_value_ptr = m_impact_header;
+    ANT_compressable_integer *doc_count_ptr = m_impact_header + the_quantum_count;
+    ANT_compressable_integer *impact_offset_start = m_impact_header + the_quantum_count * 2;
+    ANT_compressable_integer *impact_offset_ptr = impact_offset_start;
+
+    segments.docids.clear();
+    segments.impacts.clear();
+    segments.ends.clear();
+    segments.docids.reserve(leaf.local_document_frequency);
+    segments.impacts.reserve(the_quantum_count);
+    segments.ends.reserve(the_quantum_count);
+
+    while (doc_count_ptr < impact_offset_start) {
+      m_factory.decompress(m_raw, postings_list + beginning_of_the_postings + *impact_offset_ptr, *doc_count_ptr);
+      docid = -1;
+      current = m_raw;
+      end = m_raw + *doc_count_ptr;
+      while (current < end) {
+        docid += *current++;
+        segments.docids.push_back(docid);
+      }
+      segments.impacts.push_back(*impact_value_ptr);
+      segments.ends.push_back(segments.docids.size());
+      impact_value_ptr++;
+      impact_offset_ptr++;
+      doc_count_ptr++;
+    }
+  }
+};
+
+// Collects the terms of every document for the graph bisection. A term in
+// one document has no gap to shorten and is left out. The postings are
+// read twice: the first pass counts the terms of every document, so the
+// second one writes them straight into place.
+forward_index read_forward_index(ANT_search_engine& search_engine,
+                                 atire_postings_reader& reader)
+{
+  forward_index fwd;
+  size_t num_docs = search_engine.document_count();
+  ANT_search_engine_btree_leaf leaf;
+  ANT_btree_iterator iter(&search_engine);
+  impact_segments segments;
+  // calls fn with the id of every term kept, its postings in segments
+  auto for_each_term = [&](const std::function<void(uint32_t)>& fn) {
+    uint32_t term_id = 0;
+    for (char *term = iter.first(NULL); term != NULL; term = iter.next()) {
+      if (*term == '~')
+        break;
+      iter.get_postings_details(&leaf);
+      if (leaf.local_document_frequency < 2)
+        continue;
+      reader.read(leaf, segments);
+      fn(term_id++);
+    }
+    return term_id;
+  };
+
+  // the terms of document d end up at starts[d] to starts[d+1]-1
+  fwd.starts.assign(num_docs + 1, 0);
+  fwd.num_terms = for_each_term([&](uint32_t) {
+    for (auto docid : segments.docids)
+      fwd.starts[docid + 1]++;
+  });
+  for (size_t d = 0; d < num_docs; d++)
+    fwd.starts[d + 1] += fwd.starts[d];
+
+  fwd.terms.resize(fwd.starts[num_docs]);
+  std::vector<uint64_t> cursors(fwd.starts.begin(), fwd.starts.end() - 1);
+  for_each_term([&](uint32_t term_id) {
+    for (auto docid : segments.docids)
+      fwd.terms[cursors[docid]++] = term_id;
+  });
+  return fwd;
+}
+
+// Postings lists of consecutive terms, compressed together by one worker
+struct term_batch {
+  uint64_t seq = 0;
+  uint64_t num_postings = 0;
+  std::vector<impact_segments> terms;
+  std::vector<list_writer> compressed;
+};
+
+// Compresses batches on a pool of threads and hands them to a writer
+// thread in the order they were submitted. submit() blocks while the
+// window of batches read but not yet written is full, so memory stays
+// bounded however large the collection is.
+class batch_pipeline {
+public:
+  using batch_fn = std::function<void(term_batch&)>;
+private:
+  batch_fn m_compress;
+  batch_fn m_write;
+  size_t m_window;
+  std::mutex m_mutex;
+  std::condition_variable m_work_ready;
+  std::condition_variable m_batch_done;
+  std::condition_variable m_window_free;
+  std::deque<std::unique_ptr<term_batch>> m_pending;
+  std::map<uint64_t, std::unique_ptr<term_batch>> m_compressed;
+  uint64_t m_submitted = 0;
+  uint64_t m_written = 0;
+  bool m_closing = false;
+  std::vector<std::thread> m_workers;
+  std::thread m_writer;
+
+public:
+  batch_pipeline(const size_t threads, batch_fn compress, batch_fn write)
+    : m_compress(compress), m_write(write),
+      m_window(threads * BATCHES_PER_THREAD) {
+    for (size_t i = 0; i < threads; i++)
+      m_workers.emplace_back(&batch_pipeline::work, this);
+    m_writer = std::thread(&batch_pipeline::write, this);
+  }
+
+  void submit(std::unique_ptr<term_batch> batch) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_window_free.wait(lock, [&] {
+      return m_submitted - m_written < m_window;
+    });
+    batch->seq = m_submitted++;
+    m_pending.push_back(std::move(batch));
+    m_work_ready.notify_one();
+  }
+
+  // Waits until every submitted batch is written
+  void finish() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_closing = true;
+    }
+    m_work_ready.notify_all();
+    for (auto& worker : m_workers)
+      worker.join();
+    m_batch_done.notify_all();
+    m_writer.join();
+  }
+
+private:
+  void work() {
+    while (true) {
+      std::unique_ptr<term_batch> batch;
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_work_ready.wait(lock, [&] {
+          return m_closing || !m_pending.empty();
+        });
+        if (m_pending.empty())
+          return;
+        batch = std::move(m_pending.front());
+        m_pending.pop_front();
+      }
+      m_compress(*batch);
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        uint64_t seq = batch->seq;
+        m_compressed[seq] = std::move(batch);
+      }
+      m_batch_done.notify_all();
+    }
+  }
+
+  void write() {
+    while (true) {
+      std::unique_ptr<term_batch> batch;
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_batch_done.wait(lock, [&] {
+          return m_compressed.count(m_written) ||
+                 (m_closing && m_written == m_submitted);
+        });
+        auto next = m_compressed.find(m_written);
+        if (next == m_compressed.end())
+          return;
+        batch = std::move(next->second);
+        m_compressed.erase(next);
+      }
+      m_write(*batch);
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_written++;
+      }
+      m_window_free.notify_one();
+    }
+  }
+};
+
+// Compresses a docid sorted list into blocks of t_block_size postings. An
+// empty list is written as a dummy.
+template<uint64_t t_block_size, class t_rank>
+list_writer compress_postings_list(const std::unique_ptr<t_rank>& ranker,
+                         sdsl::int_vector<32>& ids,
+                         sdsl::int_vector<32>& freqs,
+                         const index_form index_format,
+                         const uint8_t block_max_bits,
+                         const postings_codec codec,
+                         const size_t variable_block_avg)
+{
+  using list_type = block_postings_list<t_block_size>;
+  std::shared_ptr<list_type> pl;
+  if (ids.size() == 0) {
+    pl = std::make_shared<list_type>();
+  } else {
+    pl = std::make_shared<list_type>(ranker, ids, freqs, index_format,
+                                     block_max_bits, codec,
+                                     variable_block_avg);
+  }
+  return [pl](std::ostream& ofs) { sdsl::serialize(*pl, ofs); };
+}
+
+// Picks the instantiation for a block size chosen at build time
+template<class t_rank>
+list_writer compress_postings_list(const size_t block_size,
+                         const std::unique_ptr<t_rank>& ranker,
+                         sdsl::int_vector<32>& ids,
+                         sdsl::int_vector<32>& freqs,
+                         const index_form index_format,
+                         const uint8_t block_max_bits,
+                         const postings_codec codec,
+                         const size_t variable_block_avg)
+{
+  switch (block_size) {
+    case 64:
+      return compress_postings_list<64>(ranker, ids, freqs, index_format,
+                                        block_max_bits, codec,
+                                        variable_block_avg);
+    case 256:
+      return compress_postings_list<256>(ranker, ids, freqs, index_format,
+                                         block_max_bits, codec,
+                                         variable_block_avg);
+    default:
+      return compress_postings_list<128>(ranker, ids, freqs, index_format,
+                                         block_max_bits, codec,
+                                         variable_block_avg);
+  }
+}
 
 
 int main(int argc, char **argv)
@@ -23,30 +388,108 @@ int main(int argc, char **argv)
 	ANT_ANT_param_block params(argc, argv);
 	long last_param = params.parse();
 
-	if (last_param == argc)
+	if (argc - last_param < 2 || argc - last_param > 8)
 	{
 		std::cout << "USAGE: " << argv[0];
-		std::cout << " [ATIRE options] <collection folder> <index_type>\n" 
-              << " index type can be `BMW` or `WAND`" << std::endl;
+		std::cout << " [ATIRE options] <collection folder> <index_type>"
+              << " [<block max bits>] [<codec>] [BLOCK:<size>]"
+              << " [VARIABLE[:<avg>]] [THREADS:<n>] [REORDER:<order>]\n"
+              << " index type can be `BMW`, `WAND` or `SAAT`\n"
+              << " block max bits can be 8 or 16 to quantize BMW block maximums\n"
+              << " codec can be `QMX` (default), `QMX_D4`, `SIMD_BP128`,"
+              << " `SIMD_FASTPFOR` or `VBYTE`\n"
+              << " BLOCK sets the postings per block to 64, 128 (default) or 256\n"
+              << " VARIABLE places BMW block boundaries by score, with <avg>"
+              << " postings per block on average (default half a block)\n"
+              << " THREADS sets the threads compressing lists (default all cores)\n"
+              << " REORDER renumbers the documents by `URL` (name) or `BP`"
+              << " (graph bisection)"
+              << std::endl;
 		return EXIT_FAILURE;
 	}
 	using clock = std::chrono::high_resolution_clock;
 
-	std::string collection_folder = argv[argc-2];
-  std::string s_index_type = argv[argc-1];
+	std::string collection_folder = argv[last_param];
+  std::string s_index_type = argv[last_param+1];
+  uint8_t block_max_bits = 0;
+  postings_codec codec = QMX;
+  size_t block_size = 128;
+  bool variable_blocks = false;
+  size_t variable_block_avg = 0;
+  size_t build_threads = std::max(1u, std::thread::hardware_concurrency());
+  std::string docid_order;
+  for (int i = last_param + 2; i < argc; i++) {
+    std::string option = argv[i];
+    if (codec_from_string(option, codec))
+      continue;
+    if (option.compare(0, 6, "BLOCK:") == 0) {
+      block_size = std::atoi(option.c_str() + 6);
+      if (block_size != 64 && block_size != 128 && block_size != 256) {
+        std::cerr << "Blocks hold 64, 128 or 256 postings." << std::endl;
+        return EXIT_FAILURE;
+      }
+      continue;
+    }
+    if (option.compare(0, 8, "THREADS:") == 0) {
+      int threads = std::atoi(option.c_str() + 8);
+      if (threads < 1) {
+        std::cerr << "At least one thread compresses lists." << std::endl;
+        return EXIT_FAILURE;
+      }
+      build_threads = threads;
+      continue;
+    }
+    if (option.compare(0, 8, "REORDER:") == 0) {
+      docid_order = option.substr(8);
+      if (docid_order != "URL" && docid_order != "BP") {
+        std::cerr << "Documents are reordered by URL or BP." << std::endl;
+        return EXIT_FAILURE;
+      }
+      continue;
+    }
+    if (option == "VARIABLE") {
+      variable_blocks = true;
+      continue;
+    }
+    if (option.compare(0, 9, "VARIABLE:") == 0) {
+      int avg = std::atoi(option.c_str() + 9);
+      if (avg < 16) {
+        std::cerr << "Variable blocks hold at least 16 postings on average."
+                  << std::endl;
+        return EXIT_FAILURE;
+      }
+      variable_blocks = true;
+      variable_block_avg = avg;
+      continue;
+    }
+    int bits = std::atoi(argv[i]);
+    if (bits != 8 && bits != 16) {
+      std::cerr << "Unknown option " << option << ". Block max bits must be"
+                << " 8 or 16, codecs are QMX, QMX_D4, SIMD_BP128,"
+                << " SIMD_FASTPFOR and VBYTE." << std::endl;
+      return EXIT_FAILURE;
+    }
+    block_max_bits = bits;
+  }
 	create_directory(collection_folder);
 	std::string dict_file = collection_folder + "/dict.txt";
 	std::string doc_names_file = collection_folder + "/doc_names.txt";
 	std::string postings_file = collection_folder + "/WANDbl_postings.idx";
+	std::string postings_dir_file = collection_folder + "/WANDbl_postings.dir";
 	std::string global_info_file = collection_folder + "/global.txt";
 	std::string doclen_tfile = collection_folder + "/doc_lens.txt";
+	std::string dict_bin_file = collection_folder + "/" + DICT_BIN_FILENAME;
+	std::string doc_names_bin_file = collection_folder + "/"
+	                                 + DOC_NAMES_BIN_FILENAME;
+	std::string doclen_bin_file = collection_folder + "/"
+	                              + DOC_LENS_BIN_FILENAME;
   std::string index_type_file = collection_folder + "/index_info.txt";
 
 	std::ofstream doclen_out(doclen_tfile);
 
 	auto build_start = clock::now();
 
-  // Select the index format - BMW or WAND?
+  // Select the index format - BMW, WAND or SAAT?
   index_form index_format;
   if (s_index_type == STRING_BMW) {
     index_format = BMW;
@@ -54,6 +497,9 @@ int main(int argc, char **argv)
   else if (s_index_type == STRING_WAND) {
     index_format = WAND;
   }
+  else if (s_index_type == STRING_SAAT) {
+    index_format = SAAT;
+  }
   else {
     std::cerr << "Incorrect index type specified. Exiting." << std::endl;
     return EXIT_FAILURE;
@@ -67,6 +513,7 @@ int main(int argc, char **argv)
   ANT_memory memory;
   ANT_search_engine search_engine(&memory);
   search_engine.open(params.index_filename);
+  atire_postings_reader reader(search_engine);
 
  // Keep track of term ordering
   unordered_map<string, uint64_t> map;
@@ -75,21 +522,15 @@ int main(int argc, char **argv)
 
   std::cout << "Writing global info to " << global_info_file << "."
             << std::endl;
-  std::vector<std::string> document_names;
+  std::vector<std::string> doc_names;
 
   // dump global info; num documents in collection, num of all terms
   std::ofstream of_globalinfo(global_info_file);
   of_globalinfo << search_engine.document_count() << " "
                 << search_engine.term_count() << std::endl;
 
-  // write the lengths and names
+  // read the lengths and names
   {
-    std::cout << "Writing document lengths to " << doclen_tfile << "."
-      << std::endl;
-    std::cout << "Writing document names to " << doc_names_file << "." 
-      << std::endl;
-    std::ofstream of_doc_names(doc_names_file);
-    
     long long start = search_engine.get_variable(ATIRE_DOCUMENT_FILE_START);
     long long end = search_engine.get_variable(ATIRE_DOCUMENT_FILE_END);
     unsigned long bsize = end - start;
@@ -106,14 +547,59 @@ int main(int argc, char **argv)
     {
       for (long long i = 0; i < search_engine.document_count(); i++)
       {
-        doclen_out << lengths[i] << std::endl;
-        of_doc_names << filenames[i] << std::endl;
         doclen_vector.push_back(lengths[i]);
+        doc_names.push_back(filenames[i]);
       }
     }
 
     free(buffer);
   }
+
+  // Renumber the documents before any list is built, the lengths and names
+  // are written in the new order
+  std::vector<uint32_t> new_docids;
+  if (docid_order != "") {
+    auto reorder_start = clock::now();
+    if (docid_order == "URL") {
+      std::cout << "Ordering documents by name." << std::endl;
+      new_docids = order_by_name(doc_names);
+    } else {
+      std::cout << "Ordering documents by graph bisection." << std::endl;
+      forward_index fwd = read_forward_index(search_engine, reader);
+      new_docids = recursive_graph_bisection(fwd, build_threads).order();
+    }
+    std::vector<uint64_t> old_lens(doclen_vector.size());
+    std::vector<std::string> old_names(doc_names.size());
+    old_lens.swap(doclen_vector);
+    old_names.swap(doc_names);
+    for (size_t i = 0; i < new_docids.size(); i++) {
+      doclen_vector[new_docids[i]] = old_lens[i];
+      doc_names[new_docids[i]] = std::move(old_names[i]);
+    }
+    auto reorder_time_sec = std::chrono::duration_cast<std::chrono::seconds>(
+        clock::now() - reorder_start);
+    std::cout << "Documents reordered in " << reorder_time_sec.count()
+              << " seconds." << std::endl;
+  }
+
+  // write the lengths and names
+  {
+    std::cout << "Writing document lengths to " << doclen_tfile << "."
+      << std::endl;
+    std::cout << "Writing document names to " << doc_names_file << "." 
+      << std::endl;
+    std::ofstream of_doc_names(doc_names_file);
+    for (size_t i = 0; i < doc_names.size(); i++) {
+      doclen_out << doclen_vector[i] << std::endl;
+      of_doc_names << doc_names[i] << std::endl;
+    }
+
+    // binary copies, mapped by search_index instead of parsing the text
+    std::ofstream doclen_bin_out(doclen_bin_file, std::ios::binary);
+    write_doc_lengths(doclen_bin_out, doclen_vector);
+    std::ofstream doc_names_bin_out(doc_names_bin_file, std::ios::binary);
+    document_names(doc_names).serialize(doc_names_bin_out);
+  }
   // write dictionary
   {
     std::cout << "Writing dictionary to " << dict_file << "." << std::endl;
@@ -122,6 +608,9 @@ int main(int argc, char **argv)
     ANT_search_engine_btree_leaf leaf;
     ANT_btree_iterator iter(&search_engine);
 
+    // the term_dictionary keeps the last id of a term listed twice, as
+    // when dict.txt is loaded
+    std::vector<std::pair<std::string,uint64_t>> dict_terms;
     size_t j = 2;
     for (char *term = iter.first(NULL); term != NULL; term = iter.next()) {
       iter.get_postings_details(&leaf);
@@ -130,39 +619,61 @@ int main(int argc, char **argv)
         << leaf.local_collection_frequency << " "
         << "\n";
       map.emplace(strdup(term), j);
+      dict_terms.emplace_back(term, j);
       j++;
     }
+
+    std::ofstream of_dict_bin(dict_bin_file, std::ios::binary);
+    term_dictionary(std::move(dict_terms)).serialize(of_dict_bin);
   }
 
-  // ranker is a unique_ptr to the ranker type
-  std::unique_ptr<generic_rank> ranker;
+  // Only one of the rankers is set. Lists are built with the concrete
+  // type so that scoring their postings needs no virtual calls.
+  std::unique_ptr<rank_impact> impact_ranker;
+  std::unique_ptr<rank_bm25> bm25_ranker;
   // Use quant ranker
   
   if (search_engine.quantized()) {
-    ranker = std::unique_ptr<generic_rank>(new rank_impact); 
+    impact_ranker = std::unique_ptr<rank_impact>(new rank_impact); 
     std::cerr << "You provided a pre-quantized ATIRE index, so I am building" 
               << " a quantized index." << std::endl;
     index_file_output << STRING_QUANT << std::endl; // keep track of index type
   }
   else {
-    ranker = std::unique_ptr<generic_rank>(new rank_bm25(doclen_vector, search_engine.term_count()));
+    bm25_ranker = std::unique_ptr<rank_bm25>(new rank_bm25(doclen_vector, search_engine.term_count()));
     std::cerr << "You provided a frequency ATIRE index, so I am building" 
               << " a frequency index." << std::endl;
     index_file_output << STRING_FREQ << std::endl; // keep track of index type
 
   }
+  if (index_format == SAAT) {
+    // SAAT accumulates the impacts as they are, it has no ranker
+    if (!impact_ranker) {
+      std::cerr << "SAAT indexes need a pre-quantized ATIRE index." << std::endl;
+      return EXIT_FAILURE;
+    }
+    if (codec != QMX) {
+      std::cerr << "SAAT segments are always compressed with QMX." << std::endl;
+      codec = QMX;
+    }
+  }
+  if (variable_blocks && index_format != BMW) {
+    std::cerr << "Variable blocks only apply to BMW indexes." << std::endl;
+    variable_blocks = false;
+  }
+  if (!variable_blocks)
+    variable_block_avg = 0;
+  else if (variable_block_avg == 0)
+    variable_block_avg = block_size / 2;
+  index_file_output << STRING_CODECS[codec] << std::endl;
+  index_file_output << block_size << std::endl;
+  std::cerr << "Compressing postings with " << STRING_CODECS[codec]
+            << " in blocks of " << block_size << "." << std::endl;
 
   // write inverted files
   {
-    using plist_type = block_postings_list<128>;
-    vector<plist_type> m_postings_lists;
-    vector<vector<pair<uint64_t, uint64_t>>> temp_postings_lists;
-    uint64_t a = 0, b = 0;
     uint64_t n_terms = search_engine.get_unique_term_count() + INDRI_OFFSET; // + 2 to skip 0 and 1
  
-    vector<pair<uint64_t, uint64_t>> post; 
-    post.reserve(INIT_SZ);
-
     // Open the files
     filebuf post_file;
     post_file.open(postings_file, std::ios::out);
@@ -170,30 +681,76 @@ int main(int argc, char **argv)
 
     std::cerr << "Generating postings lists ..." << std::endl;
 
-    m_postings_lists.resize(n_terms);
-
 
     ANT_search_engine_btree_leaf leaf;
     ANT_btree_iterator iter(&search_engine);
-    ANT_impact_header impact_header;
-    ANT_compression_factory factory;
-
-    ANT_compressable_integer *raw;
-    long long impact_header_size = ANT_impact_header::NUM_OF_QUANTUMS * sizeof(ANT_compressable_integer) * 3;
-    ANT_compressable_integer *impact_header_buffer = (ANT_compressable_integer *)malloc(impact_header_size);
-    auto postings_list_size = search_engine.get_postings_buffer_length();
-    auto raw_list_size = sizeof(*raw) * (search_engine.document_count() + ANT_COMPRESSION_FACTORY_END_PADDING);
-    unsigned char *postings_list = (unsigned char *)malloc((size_t)postings_list_size);
-    raw = (ANT_compressable_integer *)malloc((size_t)raw_list_size);
     uint64_t term_count = 0;
 
     size_t num_lists = n_terms;
     cout << "Writing " << num_lists << " postings lists." << endl;
     sdsl::serialize(num_lists, ofs);
 
+    // byte offset of every list, so a mapped index can reach any list
+    // without parsing the ones before it
+    std::vector<uint64_t> list_offsets;
+    list_offsets.reserve(num_lists);
+
+    // compresses a list in the chosen format, empty lists become dummies
+    auto compress_list = [&](const impact_segments& term) -> list_writer {
+      if (index_format == SAAT) {
+        // SAAT keeps the impact ordered segments
+        vector<pair<uint64_t, uint64_t>> list;
+        list.reserve(term.docids.size());
+        for (size_t s = 0, i = 0; s < term.impacts.size(); s++) {
+          for (; i < term.ends[s]; i++)
+            list.emplace_back(term.docids[i], term.impacts[s]);
+        }
+        auto pl = list.empty() ? std::make_shared<impact_postings_list>()
+                               : std::make_shared<impact_postings_list>(list);
+        return [pl](std::ostream& ofs) { sdsl::serialize(*pl, ofs); };
+      }
+      sdsl::int_vector<32> ids(term.docids.size());
+      sdsl::int_vector<32> freqs(term.docids.size());
+      merge_segments(term, ids, freqs);
+      if (impact_ranker) {
+        return compress_postings_list(block_size, impact_ranker, ids, freqs,
+                                      index_format, block_max_bits, codec,
+                                      variable_block_avg);
+      }
+      return compress_postings_list(block_size, bm25_ranker, ids, freqs,
+                                    index_format, block_max_bits, codec,
+                                    variable_block_avg);
+    };
+    auto write_list = [&](const list_writer& writer) {
+      list_offsets.push_back(ofs.tellp());
+      writer(ofs);
+    };
+    impact_segments no_postings;
+
     // take the 0 and 1 terms with dummies
-    sdsl::serialize(block_postings_list<128>(), ofs);
-    sdsl::serialize(block_postings_list<128>(), ofs);
+    for (size_t i = 0; i < INDRI_OFFSET; i++) {
+      write_list(compress_list(no_postings));
+    }
+
+    // The B-tree is read on this thread, the lists of a batch are sorted
+    // and compressed by one of the workers and the writer appends the
+    // batches to the postings file in term order
+    auto compress_batch = [&](term_batch& batch) {
+      for (auto& term : batch.terms) {
+        if (!new_docids.empty())
+          renumber_segments(term, new_docids);
+        batch.compressed.push_back(compress_list(term));
+        term = impact_segments();
+      }
+    };
+    auto write_batch = [&](term_batch& batch) {
+      for (const auto& writer : batch.compressed)
+        write_list(writer);
+    };
+    std::cerr << "Compressing on " << build_threads << " threads."
+              << std::endl;
+    batch_pipeline pipeline(build_threads, compress_batch, write_batch);
+    std::unique_ptr<term_batch> batch(new term_batch);
 
      for (char *term = iter.first(NULL); term != NULL; term_count++, term = iter.next())
     {
@@ -202,55 +759,41 @@ int main(int argc, char **argv)
         break;
 
       iter.get_postings_details(&leaf);
-      postings_list = search_engine.get_postings(&leaf, postings_list);
-
-      auto the_quantum_count = ANT_impact_header::get_quantum_count(postings_list);
-      auto beginning_of_the_postings = ANT_impact_header::get_beginning_of_the_postings(postings_list);
-      factory.decompress(impact_header_buffer, postings_list + ANT_impact_header::INFO_SIZE, the_quantum_count * 3);
+      batch->terms.emplace_back();
+      auto& segments = batch->terms.back();
+      reader.read(leaf, segments);
 
       if (term_count % 100000 == 0) {
       /* if (true) { */
-        std::cout << term << " @ " << leaf.postings_position_on_disk << " (cf:" << leaf.local_collection_frequency << ", df:" << leaf.local_document_frequency << ", q:" << the_quantum_count << ")" << std::endl;
+        std::cout << term << " @ " << leaf.postings_position_on_disk << " (cf:" << leaf.local_collection_frequency << ", df:" << leaf.local_document_frequency << ", q:" << segments.impacts.size() << ")" << std::endl;
 		fflush(stdout);
       }
 
-      long long docid, max_docid, sum;
-      ANT_compressable_integer *impact_header = (ANT_compressable_integer *)impact_header_buffer;
-      ANT_compressable_integer *current, *end;
-
-      max_docid = sum = 0;
-      ANT_compressable_integer *impact_value_ptr = impact_header;
-      ANT_compressable_integer *doc_count_ptr = impact_header + the_quantum_count;
-      ANT_compressable_integer *impact_offset_start = impact_header + the_quantum_count * 2;
-      ANT_compressable_integer *impact_offset_ptr = impact_offset_start;
-
-      post.clear();
-      post.reserve(leaf.local_document_frequency);
-
-
-      while (doc_count_ptr < impact_offset_start) {
-        factory.decompress(raw, postings_list + beginning_of_the_postings + *impact_offset_ptr, *doc_count_ptr);
-        docid = -1;
-        current = raw;
-        end = raw + *doc_count_ptr;
-        while (current < end) {
-          docid += *current++;
-          post.emplace_back(docid, *impact_value_ptr);
-        }
-        impact_value_ptr++;
-        impact_offset_ptr++;
-        doc_count_ptr++;
+      batch->num_postings += segments.docids.size();
+      if (batch->terms.size() == BATCH_TERMS ||
+          batch->num_postings >= BATCH_POSTINGS) {
+        pipeline.submit(std::move(batch));
+        batch.reset(new term_batch);
       }
-
-      // The above will result in sorted by impact first, so re-sort by docid
-      std::sort(std::begin(post), std::end(post));
-
-      plist_type pl(ranker, post, index_format);
-      sdsl::serialize(pl, ofs);
-
+    }
+    if (!batch->terms.empty())
+      pipeline.submit(std::move(batch));
+    pipeline.finish();
+
+    // terms after the first '~' term are not written, fill them with
+    // dummies so the file really holds num_lists lists
+    while (list_offsets.size() < num_lists) {
+      write_list(compress_list(no_postings));
     }
     //close output files
     post_file.close();
+
+    std::cout << "Writing postings directory to " << postings_dir_file << "."
+              << std::endl;
+    std::ofstream dir_out(postings_dir_file);
+    sdsl::write_member(num_lists, dir_out);
+    dir_out.write((const char*)list_offsets.data(),
+                  list_offsets.size()*sizeof(uint64_t));
   }
 
 	auto build_stop = clock::now();
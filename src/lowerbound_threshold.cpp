@@ -1,206 +1,164 @@
-#include <string>
 #include <algorithm>
-#include <numeric>
-#include <unordered_map>
-#include <vector>
+#include <cstdint>
+#include <utility>
 #include "lowerbound_threshold.hpp"
 
-bool subset_max_exists(const std::vector<std::string>& subsets,
+// Term ids of a query, sorted, in a stack buffer
+struct subset_terms {
+  std::uint64_t ids[MAX_SUBSET_TERMS];
+  std::size_t size;
+
+  explicit subset_terms(const query_t& query) {
+    size = std::min(query.tokens.size(), MAX_SUBSET_TERMS);
+    for (std::size_t i = 0; i < size; i++)
+      ids[i] = query.tokens[i].token_id;
+    std::sort(ids, ids + size);
+  }
+};
+
+// Calls fn with the key of every r term subset of ids[0..n). The keys of
+// the subset prefixes are kept, so moving to the next subset only rehashes
+// the terms that changed.
+template<class t_fn>
+void for_each_subset(const std::uint64_t* ids, std::size_t n, std::size_t r,
+                     t_fn fn) {
+  if (r == 0 || r > n)
+    return;
+
+  std::uint32_t ptrs[MAX_SUBSET_TERMS];
+  std::uint64_t prefix_keys[MAX_SUBSET_TERMS];
+  std::size_t changed = 0;
+  for (std::size_t i = 0; i < r; i++)
+    ptrs[i] = i;
+
+  while (true) {
+    for (std::size_t i = changed; i < r; i++) {
+      std::uint64_t prev = i > 0 ? prefix_keys[i - 1] : 0;
+      prefix_keys[i] = add_term_to_key(prev, ids[ptrs[i]]);
+    }
+    fn(prefix_keys[r - 1]);
+
+    // advance to the next subset in lexicographic order
+    std::size_t i = r;
+    while (i > 0 && ptrs[i - 1] == n - r + i - 1)
+      i--;
+    if (i == 0)
+      return;
+    changed = i - 1;
+    ptrs[changed]++;
+    for (std::size_t j = changed + 1; j < r; j++)
+      ptrs[j] = ptrs[j - 1] + 1;
+  }
+}
+
+bool subset_max_exists(const std::uint64_t* ids, std::size_t n, std::size_t r,
                        double& max_threshold, const cache_t& cache) {
   bool exists = false;
 
-  for (const auto& s : subsets) {
-    bool in_cache = cache.find(s) != cache.end();
+  for_each_subset(ids, n, r, [&](std::uint64_t key) {
+    double threshold;
 
-    if (in_cache) {
+    if (cache.find(key, threshold)) {
       exists = true;
-      double threshold = cache.at(s);
       if (threshold > max_threshold)
         max_threshold = threshold;
     }
-  }
+  });
 
   return exists;
 }
 
-bool next_subset(std::vector<std::uint32_t>& ptrs,
-                 const std::vector<std::uint32_t>& end_ptrs,
-                 std::uint32_t r) {
-  for (int i = r - 1; i > -1; i--) {
-    if (ptrs[i] < end_ptrs[i]) {
-      ptrs[i]++;
-      std::uint32_t moved = ptrs[i];
-
-      for (int j = i + 1; j < r; j++) {
-        ptrs[j] = moved + 1;
-        moved++;
-      }
-
-      return true;
-    }
-  }
-
-  return false;
-}
-
-std::vector<std::string> gen_subsets(const std::vector<query_token>& tokens,
-                                     std::uint32_t r) {
-  std::uint32_t n = tokens.size();
-  std::vector<std::string> subsets;
-
-  if (r <= n && r > 0) {
-    std::vector<std::uint32_t> ptrs(r);
-    std::iota(std::begin(ptrs), std::end(ptrs), 0);
-
-    std::vector<std::uint32_t> end_ptrs(r);
-    std::iota(std::begin(end_ptrs), std::end(end_ptrs), n - r);
-
-    do {
-      std::string subset = tokens[ptrs[0]].token_str;
-
-      for (int i = 1; i < r; i++)
-        subset += " " + tokens[ptrs[i]].token_str;
-
-      subsets.push_back(subset);
-
-    } while (next_subset(ptrs, end_ptrs, r));
-  }
-
-  return subsets;
-}
-
 double naive_threshold(const query_t& query, const cache_t& cache) {
   return 0.0;
 }
 
 double hr1_threshold(const query_t& query, const cache_t& cache) {
   double threshold = 0.0;
-  std::vector<query_token> tokens = query.tokens;
-  int len_tokens = tokens.size();
+  subset_terms terms(query);
+  std::size_t len_tokens = terms.size;
 
   if (len_tokens > 3) {
-    if (subset_max_exists(gen_subsets(tokens, 3), threshold, cache))
+    if (subset_max_exists(terms.ids, len_tokens, 3, threshold, cache))
       return threshold;
   }
 
   if (len_tokens > 2) {
-    if (subset_max_exists(gen_subsets(tokens, 2), threshold, cache))
+    if (subset_max_exists(terms.ids, len_tokens, 2, threshold, cache))
       return threshold;
   }
 
   if (len_tokens > 1)
-    subset_max_exists(gen_subsets(tokens, 1), threshold, cache);
+    subset_max_exists(terms.ids, len_tokens, 1, threshold, cache);
 
   return threshold;
 }
 
 double hr2_threshold(const query_t& query, const cache_t& cache) {
   double threshold = 0.0;
-  std::vector<query_token> tokens = query.tokens;
-  int len_tokens = tokens.size();
-  std::vector<std::string> subsets;
+  subset_terms terms(query);
+  std::size_t len_tokens = terms.size;
 
-  if (len_tokens > 3) {
-    std::vector<std::string> subsets3 = gen_subsets(tokens, 3);
-    subsets.insert(subsets.end(), subsets3.begin(), subsets3.end());
-  }
+  if (len_tokens > 3)
+    subset_max_exists(terms.ids, len_tokens, 3, threshold, cache);
 
-  if (len_tokens > 2) {
-    std::vector<std::string> subsets2 = gen_subsets(tokens, 2);
-    subsets.insert(subsets.end(), subsets2.begin(), subsets2.end());
-  }
+  if (len_tokens > 2)
+    subset_max_exists(terms.ids, len_tokens, 2, threshold, cache);
 
-  if (len_tokens > 1) {
-    std::vector<std::string> subsets1 = gen_subsets(tokens, 1);
-    subsets.insert(subsets.end(), subsets1.begin(), subsets1.end());
-  }
+  if (len_tokens > 1)
+    subset_max_exists(terms.ids, len_tokens, 1, threshold, cache);
 
-  subset_max_exists(subsets, threshold, cache);
   return threshold;
 }
 
 double hr3_threshold(const query_t& query, const cache_t& cache) {
   double threshold = 0.0;
-  std::vector<query_token> tokens = query.tokens;
-  std::vector<std::string> subsets = gen_subsets(tokens, tokens.size() - 1);
-  subset_max_exists(subsets, threshold, cache);
+  subset_terms terms(query);
+  subset_max_exists(terms.ids, terms.size, terms.size - 1, threshold, cache);
   return threshold;
 }
 
-double hr4_threshold_old(const query_t& query, const cache_t& cache) {
-  std::vector<query_token> tokens = query.tokens;
-  std::vector<query_token> tokens_df_sorted(std::begin(tokens),
-                                            std::end(tokens));
-  // Sort descending by doc freq
-  std::sort(std::begin(tokens_df_sorted), std::end(tokens_df_sorted),
-            [](const query_token& a, const query_token& b) -> bool {
-              return a.df > b.df;
-            });
-  int tokens_len = tokens.size();
-  for (int i = tokens_len - 1; i >= 1; i--) {
-    auto tok_head = tokens_df_sorted.begin();
-    std::vector<query_token> sub_tokens(tok_head, tok_head + i);
-    std::sort(sub_tokens.begin(), sub_tokens.end());
-    std::string subset = sub_tokens[0].token_str;
-
-    for (int j = 1; j < sub_tokens.size(); j++)
-      subset += " " + sub_tokens[j].token_str;
-
-    if (cache.find(subset) != cache.end())
-      return cache.at(subset);
-  }
-
-  return 0.0;
-}
-
 double hr4_threshold(const query_t& query, const cache_t& cache) {
-  std::vector<query_token> tokens = query.tokens;
-  std::vector<query_token> tokens_df_sorted(tokens.begin(), tokens.end());
+  std::size_t len_tokens = std::min(query.tokens.size(), MAX_SUBSET_TERMS);
+  std::pair<std::uint64_t, std::uint64_t> tokens_df[MAX_SUBSET_TERMS];
+  for (std::size_t i = 0; i < len_tokens; i++)
+    tokens_df[i] = {query.tokens[i].df, query.tokens[i].token_id};
 
   // Sort descending by doc freq
-  std::sort(std::begin(tokens_df_sorted), std::end(tokens_df_sorted),
-            [](const query_token& a, const query_token& b) -> bool {
-              return a.df > b.df;
+  std::sort(tokens_df, tokens_df + len_tokens,
+            [](const std::pair<std::uint64_t, std::uint64_t>& a,
+               const std::pair<std::uint64_t, std::uint64_t>& b) -> bool {
+              return a.first > b.first;
             });
 
-  std::size_t max_subset_len = std::min<std::size_t>(
-      3, tokens_df_sorted.size() - 1);
+  std::size_t max_subset_len = std::min<std::size_t>(3, len_tokens - 1);
 
-  auto tdf_begin = tokens_df_sorted.begin();
-  std::vector<query_token> max_subset(tdf_begin, tdf_begin + max_subset_len);
-  std::sort(max_subset.begin(), max_subset.end());
-  std::vector<std::string> subsets;
-  for (int i = max_subset_len; i > 0; --i) {
-    std::vector<std::string> subsets_i = gen_subsets(max_subset, i);
-    subsets.insert(subsets.end(), subsets_i.begin(), subsets_i.end());
-  }
+  std::uint64_t max_subset[3];
+  for (std::size_t i = 0; i < max_subset_len; i++)
+    max_subset[i] = tokens_df[i].second;
+  std::sort(max_subset, max_subset + max_subset_len);
 
   double threshold = 0.0;
-  subset_max_exists(subsets, threshold, cache);
+  for (std::size_t i = max_subset_len; i > 0; --i)
+    subset_max_exists(max_subset, max_subset_len, i, threshold, cache);
   return threshold;
 }
 
 double all_threshold(const query_t& query, const cache_t& cache) {
-  std::vector<query_token> tokens = query.tokens;
-  std::vector<std::string> subsets;
-  std::size_t start_len_subset = tokens.size() - 1;
+  subset_terms terms(query);
+  double threshold = 0.0;
 
-  for (std::size_t i = start_len_subset; i > 0; --i) {
-    std::vector<std::string> ilen_subsets = gen_subsets(tokens, i);
-    subsets.insert(subsets.end(), ilen_subsets.begin(), ilen_subsets.end());
-  }
+  for (std::size_t i = terms.size - 1; i > 0; --i)
+    subset_max_exists(terms.ids, terms.size, i, threshold, cache);
 
-  double threshold = 0.0;
-  subset_max_exists(subsets, threshold, cache);
   return threshold;
 }
 
 
 double ts_threshold(const query_t& query, const cache_t& cache,
                     const cache_t& term_cache) {
-  std::vector<std::string> subsets1 = gen_subsets(query.tokens, 1);
+  subset_terms terms(query);
   double max_threshold = 0.0;
-  subset_max_exists(subsets1, max_threshold, term_cache);
+  subset_max_exists(terms.ids, terms.size, 1, max_threshold, term_cache);
   return max_threshold;
 }
 
@@ -208,19 +166,16 @@ double hr1_ts_threshold(const query_t& query, const cache_t& cache,
                         const cache_t& term_cache) {
   double max_threshold = ts_threshold(query, cache, term_cache);
 
-  std::vector<query_token> tokens = query.tokens;
-  int len_tokens = tokens.size();
+  subset_terms terms(query);
+  std::size_t len_tokens = terms.size;
 
   if (len_tokens > 3) {
-    std::vector<std::string> subsets3 = gen_subsets(tokens, 3);
-    if (subset_max_exists(subsets3, max_threshold, cache))
+    if (subset_max_exists(terms.ids, len_tokens, 3, max_threshold, cache))
       return max_threshold;
   }
 
-  if (len_tokens > 2) {
-    std::vector<std::string> subsets2 = gen_subsets(tokens, 2);
-    subset_max_exists(subsets2, max_threshold, cache);
-  }
+  if (len_tokens > 2)
+    subset_max_exists(terms.ids, len_tokens, 2, max_threshold, cache);
 
   return max_threshold;
 }
@@ -229,15 +184,11 @@ double hr2_ts_threshold(const query_t& query, const cache_t& cache,
                         const cache_t& term_cache) {
   double max_threshold = ts_threshold(query, cache, term_cache);
 
-  std::vector<query_token> tokens = query.tokens;
-  int len_tokens = tokens.size();
-  std::vector<std::string> subsets;
+  subset_terms terms(query);
+  int len_tokens = terms.size;
 
-  for (int i = std::min(len_tokens - 1, 6); i > 1; --i) {
-    std::vector<std::string> subsets_i = gen_subsets(tokens, i);
-    subsets.insert(subsets.end(), subsets_i.begin(), subsets_i.end());
-  }
+  for (int i = std::min(len_tokens - 1, 6); i > 1; --i)
+    subset_max_exists(terms.ids, len_tokens, i, max_threshold, cache);
 
-  subset_max_exists(subsets, max_threshold, cache);
   return max_threshold;
 }
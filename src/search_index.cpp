@@ -4,12 +4,15 @@
 #include <iomanip>
 #include <ctime>
 #include <string>
+#include <atomic>
+#include <thread>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include "query.hpp"
 #include "invidx.hpp"
+#include "saat_invidx.hpp"
 #include "generic_rank.hpp"
 #include "impact.hpp"
 #include "bm25.hpp"
@@ -19,7 +22,6 @@ typedef struct cmdargs {
   std::string collection_dir;
   std::string query_file;
   std::string postings_file;
-  std::string doclen_file;
   std::string global_file;
   std::string output_prefix;
   std::string index_type_file;
@@ -27,12 +29,19 @@ typedef struct cmdargs {
   double F_boost;
   query_traversal traversal;
   std::string traversal_string;
+  query_algorithm algorithm;
   std::string cache_file;
   std::string term_cache_file;
   bool dyn_cache;
   bool report_only_time;
   std::uint32_t num_runs;
   std::string threshold_method;
+  bool use_mmap;
+  std::uint32_t num_threads;
+  std::uint32_t intra_threads;
+  std::uint64_t cache_budget;
+  std::uint64_t postings_budget;
+  std::uint32_t batch_size;
 } cmdargs_t;
 
 void print_usage(std::string program) {
@@ -42,12 +51,19 @@ void print_usage(std::string program) {
             << " -z <F: aggression parameter. 1.0 is rank-safe>"
             << " -o <output file handle>"
             << " -t <traversal type: AND|OR>"
+            << " -a <OR algorithm: PIVOT|MAXSCORE|BMM, default is PIVOT>"
             << " -f <static cache file>"
             << " -d <cache dynamically>"
             << " -r <only report time logs>"
             << " -n <number of runs>"
             << " -m <threshold method: HR1|HR2|HR3|HR4|ALL|TS|HR1_TS|HR2_TS, default is NAIVE>"
             << " -e <term static cache file>"
+            << " -M <mmap the postings instead of loading them>"
+            << " -p <number of query threads, default is 1>"
+            << " -s <threads each BMW OR query is split over, default is 1>"
+            << " -b <score cache budget in MB, default is 64>"
+            << " -B <postings processed per SAAT query, default is all>"
+            << " -Q <queries per batch sharing decoded blocks, default is 1>"
             << std::endl;
   exit(EXIT_FAILURE);
 }
@@ -61,6 +77,7 @@ parse_args(int argc, char* const argv[])
   args.output_prefix = "";
   args.traversal = UNKNOWN;
   args.traversal_string = "";
+  args.algorithm = PIVOT;
   args.k = 10;
   args.F_boost = 1.0;
   args.cache_file = "";
@@ -69,12 +86,17 @@ parse_args(int argc, char* const argv[])
   args.report_only_time = false;
   args.num_runs = 3;
   args.threshold_method = "NAIVE";
-  while ((op=getopt(argc,argv,"c:q:k:z:o:t:f:e:drn:m:")) != -1) {
+  args.use_mmap = false;
+  args.num_threads = 1;
+  args.intra_threads = 1;
+  args.cache_budget = score_cache::DEFAULT_BUDGET >> 20;
+  args.postings_budget = 0;
+  args.batch_size = 1;
+  while ((op=getopt(argc,argv,"c:q:k:z:o:t:a:f:e:drn:m:Mp:s:b:B:Q:")) != -1) {
     switch (op) {
       case 'c':
         args.collection_dir = optarg;
         args.postings_file = args.collection_dir + "/WANDbl_postings.idx";
-        args.doclen_file = args.collection_dir +"/doc_lens.txt";
         args.global_file = args.collection_dir +"/global.txt";
         args.index_type_file = args.collection_dir + "/index_info.txt";
         break;
@@ -99,6 +121,16 @@ parse_args(int argc, char* const argv[])
         else
           print_usage(argv[0]);
         break;
+      case 'a':
+        if (optarg == STRING_PIVOT)
+          args.algorithm = PIVOT;
+        else if (optarg == STRING_MAXSCORE)
+          args.algorithm = MAXSCORE;
+        else if (optarg == STRING_BLOCK_MAXSCORE)
+          args.algorithm = BLOCK_MAXSCORE;
+        else
+          print_usage(argv[0]);
+        break;
       case 'f':
         args.cache_file = optarg;
         break;
@@ -117,91 +149,72 @@ parse_args(int argc, char* const argv[])
       case 'm':
         args.threshold_method = optarg;
         break;
+      case 'M':
+        args.use_mmap = true;
+        break;
+      case 'p':
+        args.num_threads = std::stoul(optarg);
+        break;
+      case 's':
+        args.intra_threads = std::stoul(optarg);
+        break;
+      case 'b':
+        args.cache_budget = std::stoull(optarg);
+        break;
+      case 'B':
+        args.postings_budget = std::stoull(optarg);
+        break;
+      case 'Q':
+        args.batch_size = std::stoul(optarg);
+        break;
       case '?':
       default:
         print_usage(argv[0]);
     }
   }
   if (args.collection_dir=="" || args.query_file=="" || args.F_boost < 1 ||
-      args.traversal == UNKNOWN) {
+      args.traversal == UNKNOWN || args.k < 1 || args.num_threads < 1 ||
+      args.intra_threads < 1 || args.batch_size < 1) {
     std::cerr << "Missing/Incorrect command line parameters.\n";
     print_usage(argv[0]);
   }
+  // every query thread may split its query, keep the total within the cores
+  size_t cores = std::max(1u, std::thread::hardware_concurrency());
+  if ((size_t)args.num_threads * args.intra_threads > cores) {
+    args.intra_threads = std::max<size_t>(1, cores / args.num_threads);
+    std::cerr << "Splitting queries over at most " << args.intra_threads
+              << " thread(s) for " << args.num_threads
+              << " query thread(s) on " << cores << " cores.\n";
+  }
   return args;
 }
 
+// Loads the index, runs the queries and writes the results
+template<class t_index>
 int
-main (int argc,char* const argv[])
+run_queries(cmdargs_t& args, const index_form t_index_type,
+            const std::string& t_traversal, const std::string& t_postings)
 {
-  /* define types */
-  using plist_type = block_postings_list<128>;
-  using my_index_t = idx_invfile<plist_type, generic_rank>;
   using clock = std::chrono::high_resolution_clock;
 
-  /* parse command line */
-  cmdargs_t args = parse_args(argc,argv);
-
-  std::cout << "NOTE: Global F boost = " << args.F_boost << std::endl;
-
-  // Read the index and traversal type
-  std::ifstream read_type(args.index_type_file);
-  std::string t_traversal, t_postings;
-  read_type >> t_traversal;
-  read_type >> t_postings;
-
-  // Wand or BMW index?
-  index_form t_index_type;
-  if (t_traversal == STRING_WAND)
-    t_index_type = WAND;
-  else if (t_traversal == STRING_BMW)
-    t_index_type = BMW;
-  else {
-    std::cerr << "Index is corrupted. Please rebuild." << std::endl;
-    exit(EXIT_FAILURE);
-  }
-
-  // TF or a quant index?
-  postings_form t_postings_type;
-  if (t_postings == STRING_FREQ) {
-    t_postings_type = FREQUENCY;
-  }
-  else if (t_postings == STRING_QUANT) {
-    t_postings_type = QUANTIZED;
-  }
-  else {
-    std::cerr << "Index is corrupted. Please rebuild." << std::endl;
-    exit(EXIT_FAILURE);
-  }
-
-
   /* parse queries */
   std::cout << "Parsing query file '" << args.query_file << "'" << std::endl;
-  auto queries = query_parser::parse_queries(args.collection_dir,args.query_file);
+  auto mapping = query_parser::load_dictionary(args.collection_dir);
+  auto queries = query_parser::parse_queries(mapping,args.query_file);
   std::cout << "Found " << queries.size() << " queries." << std::endl;
 
   std::string index_name(basename(strdup(args.collection_dir.c_str())));
 
   /* load the index */
-  my_index_t index;
+  t_index index;
 
   auto load_start = clock::now();
   // Construct index instance.
-  construct(index, args.postings_file, args.F_boost);
+  construct(index, args.postings_file, args.F_boost, args.use_mmap);
 
   // Prepare Ranker
-  uint64_t temp;
-
-  std::vector<uint64_t>doc_lens;
-  ifstream doclen_file(args.doclen_file);
-  if(!doclen_file.is_open()){
-    std::cerr << "Couldn't open: " << args.doclen_file << std::endl;
-    exit(EXIT_FAILURE);
-  }
   std::cout << "Reading document lengths." << std::endl;
-  /*Read the lengths of each document from asc file into vector*/
-  while(doclen_file >> temp){
-    doc_lens.push_back(temp);
-  }
+  std::vector<uint64_t> doc_lens = load_doc_lengths(args.collection_dir);
   ifstream global_file(args.global_file);
   if(!global_file.is_open()) {
     std::cerr << "Couldn't open: " << args.global_file << std::endl;
@@ -210,9 +223,13 @@ main (int argc,char* const argv[])
   // Load the ranker
   uint64_t total_docs, total_terms;
   global_file >> total_docs >> total_terms;
-  index.load(doc_lens, total_terms, total_docs, t_postings_type);
+  index.load(doc_lens, total_terms, total_docs);
+  index.set_cache_budget(args.cache_budget << 20);
   index.set_dyn_cache(args.dyn_cache);
   index.set_threshold_method(args.threshold_method);
+  index.set_intra_query_threads(args.intra_threads);
+  index.set_postings_budget(args.postings_budget);
+  index.set_query_algorithm(args.algorithm);
 
   auto load_stop = clock::now();
   auto load_time_sec = std::chrono::duration_cast<std::chrono::seconds>(load_stop-load_start);
@@ -234,33 +251,98 @@ main (int argc,char* const argv[])
   std::cout << "Times are the average across " << avg_num_run << " runs.\n";
 
   if (args.term_cache_file != "")
-    index.load_term_cache(args.term_cache_file);
+    index.load_term_cache(args.term_cache_file, mapping);
 
   for(size_t i = 0; i < args.num_runs; i++) {
     if (args.cache_file != "") {
       std::cout << "Loading static cache with " << args.cache_file << "\n";
       index.reset_cache();
-      index.load_cache(args.cache_file);
+      index.load_cache(args.cache_file, mapping);
     }
 
     // std::cout << "Query pass no " << i + 1 << std::endl;
-    // For each query
-    for(auto& query: queries) {
-      uint64_t id = query.query_id;
-      std::vector<query_token> qry_tokens = query.tokens;
-      std::cerr << "[" << id << "] |Q|=" << qry_tokens.size();
-      std::cerr.flush();
-
-      query_stat stat;
-      // run the query
-      auto qry_start = clock::now();
-      auto results = index.search(query, args.k, t_index_type, args.traversal,
-                                  stat);
-      auto qry_stop = clock::now();
-
-      auto query_time = std::chrono::duration_cast<std::chrono::microseconds>(qry_stop-qry_start);
-      std::cerr << " TIME = " << std::setprecision(5)
-                << query_time.count() / 1000.0 << " ms\r";
+    // Per query buffers, every slot is written by exactly one worker
+    std::vector<result> run_results(queries.size());
+    std::vector<query_stat> run_stats(queries.size());
+    std::vector<std::chrono::microseconds> run_times(queries.size());
+    std::atomic<size_t> next_query(0);
+
+    // The queries of a batch share their decoded blocks, every query is
+    // timed on its own within the batch
+    auto process_batch = [&](const size_t first) {
+      size_t last = std::min<size_t>(first + args.batch_size, queries.size());
+      std::vector<query_t*> batch;
+      for (size_t q = first; q < last; q++)
+        batch.push_back(&queries[q]);
+      std::vector<query_stat> stats;
+      std::vector<std::chrono::microseconds> times;
+      auto results = index.search_batch(batch, args.k, t_index_type,
+                                        args.traversal, stats, times);
+      for (size_t i = 0; i < batch.size(); i++) {
+        run_times[first + i] = times[i];
+        run_results[first + i] = std::move(results[i]);
+        run_stats[first + i] = stats[i];
+      }
+    };
+
+    // Workers take the next unprocessed queries from the log
+    auto process_queries = [&]() {
+      size_t q;
+      while ((q = next_query.fetch_add(args.batch_size)) < queries.size()) {
+        if (args.batch_size > 1) {
+          process_batch(q);
+          continue;
+        }
+        auto& query = queries[q];
+        if (args.num_threads == 1) {
+          std::cerr << "[" << query.query_id << "] |Q|="
+                    << query.tokens.size();
+          std::cerr.flush();
+        }
+
+        query_stat stat;
+        // run the query
+        auto qry_start = clock::now();
+        auto results = index.search(query, args.k, t_index_type,
+                                    args.traversal, stat);
+        auto qry_stop = clock::now();
+
+        run_times[q] = std::chrono::duration_cast<std::chrono::microseconds>(
+            qry_stop-qry_start);
+        run_results[q] = std::move(results);
+        run_stats[q] = stat;
+
+        if (args.num_threads == 1) {
+          std::cerr << " TIME = " << std::setprecision(5)
+                    << run_times[q].count() / 1000.0 << " ms\r";
+        }
+      }
+    };
+
+    auto run_start = clock::now();
+    if (args.num_threads == 1) {
+      process_queries();
+    } else {
+      std::vector<std::thread> workers;
+      for (size_t t = 0; t < args.num_threads; t++)
+        workers.emplace_back(process_queries);
+      for (auto& worker : workers)
+        worker.join();
+    }
+    auto run_stop = clock::now();
+    std::cerr << "\n";
+
+    auto run_time = std::chrono::duration_cast<std::chrono::microseconds>(
+        run_stop-run_start);
+    std::cout << "Run " << i + 1 << ": " << queries.size() << " queries on "
+              << args.num_threads << " thread(s) in "
+              << run_time.count() / 1000.0 << " ms ("
+              << queries.size() / (run_time.count() / 1000000.0)
+              << " queries/s)" << std::endl;
+
+    for (size_t q = 0; q < queries.size(); q++) {
+      uint64_t id = queries[q].query_id;
+      auto query_time = run_times[q];
 
       if (args.num_runs < 3 || i > 0) {
         auto itr = query_times.find(id);
@@ -272,13 +354,12 @@ main (int argc,char* const argv[])
       }
 
       if(i==0) {
-        query_results[id] = results;
-        query_lengths[id] = qry_tokens.size();
-        query_stats[id] = stat;
-        rewritten_queries[id] = query.query_str;
+        query_results[id] = run_results[q];
+        query_lengths[id] = queries[q].tokens.size();
+        query_stats[id] = run_stats[q];
+        rewritten_queries[id] = queries[q].query_str;
       }
     }
-    std::cerr << "\n";
   }
 
   std::cout << "Cache hit rate is " << index.hit_rate() << "\n";
@@ -332,15 +413,7 @@ main (int argc,char* const argv[])
   // Write TREC output file.
 
   /* load the docnames map */
-  std::unordered_map<uint64_t,std::string> id_mapping;
-  std::string doc_names_file = args.collection_dir + "/doc_names.txt";
-  std::ifstream dfs(doc_names_file);
-  size_t j=0;
-  std::string name_mapping;
-  while( std::getline(dfs,name_mapping) ) {
-    id_mapping[j] = name_mapping;
-    j++;
-  }
+  document_names doc_names = document_names::load(args.collection_dir);
 
 
   if (!args.report_only_time) {
@@ -354,7 +427,7 @@ main (int argc,char* const argv[])
         for(size_t i=1;i<=qry_res.size();i++) {
           trec_out << qry_id << "\t"
                    << "Q0" << "\t"
-                   << id_mapping[qry_res[i-1].doc_id] << "\t"
+                   << doc_names[qry_res[i-1].doc_id] << "\t"
                    << i << "\t"
                    << qry_res[i-1].score << "\t"
                    << "WANDbl" << std::endl;
@@ -379,3 +452,112 @@ main (int argc,char* const argv[])
 
   return EXIT_SUCCESS;
 }
+
+// The block size and the ranker are template parameters of the index, so
+// every query is decoded and scored without virtual calls
+template<uint64_t t_block_size>
+int
+run_block_index(cmdargs_t& args, const postings_form t_postings_type,
+                const index_form t_index_type, const std::string& t_traversal,
+                const std::string& t_postings)
+{
+  using plist_type = block_postings_list<t_block_size>;
+  if (t_postings_type == FREQUENCY) {
+    return run_queries<idx_invfile<plist_type, rank_bm25>>(
+        args, t_index_type, t_traversal, t_postings);
+  }
+  return run_queries<idx_invfile<plist_type, rank_impact>>(
+      args, t_index_type, t_traversal, t_postings);
+}
+
+int
+main (int argc,char* const argv[])
+{
+  /* parse command line */
+  cmdargs_t args = parse_args(argc,argv);
+
+  std::cout << "NOTE: Global F boost = " << args.F_boost << std::endl;
+
+  // Read the index and traversal type
+  std::ifstream read_type(args.index_type_file);
+  std::string t_traversal, t_postings, t_codec;
+  uint64_t t_block_size = 128;
+  read_type >> t_traversal;
+  read_type >> t_postings;
+  // indexes from before codecs and block sizes were selectable are QMX
+  // with blocks of 128
+  if (!(read_type >> t_codec))
+    t_codec = STRING_CODECS[QMX];
+  else
+    read_type >> t_block_size;
+
+  // Wand, BMW or SAAT index?
+  index_form t_index_type;
+  if (t_traversal == STRING_WAND)
+    t_index_type = WAND;
+  else if (t_traversal == STRING_BMW)
+    t_index_type = BMW;
+  else if (t_traversal == STRING_SAAT)
+    t_index_type = SAAT;
+  else {
+    std::cerr << "Index is corrupted. Please rebuild." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  // TF or a quant index?
+  postings_form t_postings_type;
+  if (t_postings == STRING_FREQ) {
+    t_postings_type = FREQUENCY;
+  }
+  else if (t_postings == STRING_QUANT) {
+    t_postings_type = QUANTIZED;
+  }
+  else {
+    std::cerr << "Index is corrupted. Please rebuild." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  // Block maximums are only stored in BMW indexes
+  if (args.algorithm == BLOCK_MAXSCORE && t_index_type != BMW) {
+    std::cerr << "BMM needs a BMW index." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  if (args.algorithm != PIVOT && t_index_type == SAAT) {
+    std::cerr << "SAAT indexes are processed score-at-a-time, -a does not"
+              << " apply." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  if (args.batch_size > 1 && t_index_type == SAAT) {
+    std::cerr << "SAAT queries share no decoded blocks, -Q does not apply."
+              << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  // Every list records its codec, this is only reported
+  postings_codec t_codec_type;
+  if (!codec_from_string(t_codec, t_codec_type)) {
+    std::cerr << "Index is corrupted. Please rebuild." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  std::cout << "Postings codec: " << STRING_CODECS[t_codec_type] << std::endl;
+
+  if (t_index_type == SAAT) {
+    return run_queries<idx_saat>(args, t_index_type, t_traversal, t_postings);
+  }
+
+  std::cout << "Block size: " << t_block_size << std::endl;
+  switch (t_block_size) {
+    case 64:
+      return run_block_index<64>(args, t_postings_type, t_index_type,
+                                 t_traversal, t_postings);
+    case 128:
+      return run_block_index<128>(args, t_postings_type, t_index_type,
+                                  t_traversal, t_postings);
+    case 256:
+      return run_block_index<256>(args, t_postings_type, t_index_type,
+                                  t_traversal, t_postings);
+    default:
+      std::cerr << "Index is corrupted. Please rebuild." << std::endl;
+      exit(EXIT_FAILURE);
+  }
+}
@@ -0,0 +1,75 @@
+// Checks that dict.bin, as build_index writes it, maps every term to the
+// id the dict.txt loader gives it, also for terms listed twice.
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
+
+#include "index_metadata.hpp"
+
+static int failures = 0;
+
+static void check(const bool ok, const std::string& what) {
+  if (!ok) {
+    std::cerr << "FAILED: " << what << std::endl;
+    failures++;
+  }
+}
+
+static void check_id(const term_dictionary& dict, const std::string& name,
+                     const std::string& term, const uint64_t want) {
+  uint64_t id = 0;
+  check(dict.find(term, id) && id == want,
+        name + " gives " + term + " id " + std::to_string(want));
+}
+
+int main() {
+  char dir_template[] = "/tmp/term_dictionary_XXXXXX";
+  if (mkdtemp(dir_template) == NULL) {
+    std::cerr << "cannot create a temporary directory." << std::endl;
+    return EXIT_FAILURE;
+  }
+  std::string dir = dir_template;
+
+  // terms in the order of the ATIRE btree, "cat" and "ant" twice
+  std::vector<std::pair<std::string,uint64_t>> terms = {
+    {"cat", 2}, {"ant", 3}, {"bee", 4}, {"cat", 5}, {"dog", 6},
+    {"ant", 7}};
+  {
+    std::ofstream of_dict(dir + "/" + DICT_FILENAME);
+    for (const auto& term : terms)
+      of_dict << term.first << " " << term.second << " 1 1 \n";
+    std::ofstream of_dict_bin(dir + "/" + DICT_BIN_FILENAME,
+                              std::ios::binary);
+    term_dictionary(terms).serialize(of_dict_bin);
+  }
+
+  term_dictionary bin_dict = term_dictionary::load(dir);
+  term_dictionary text_dict = term_dictionary::load_text(dir);
+  for (const auto* dict : {&bin_dict, &text_dict}) {
+    std::string name = dict == &bin_dict ? "dict.bin" : "dict.txt";
+    check(dict->size() == 4, name + " holds every term once");
+    // the last entry of a term wins
+    check_id(*dict, name, "ant", 7);
+    check_id(*dict, name, "bee", 4);
+    check_id(*dict, name, "cat", 5);
+    check_id(*dict, name, "dog", 6);
+    uint64_t id = 0;
+    check(!dict->find("eel", id), name + " lacks eel");
+    check(dict->term(5) == "cat", name + " names id 5");
+    check(dict->term(2) == "", name + " forgets the replaced id 2");
+  }
+
+  unlink((dir + "/" + DICT_FILENAME).c_str());
+  unlink((dir + "/" + DICT_BIN_FILENAME).c_str());
+  rmdir(dir.c_str());
+  if (failures != 0)
+    return EXIT_FAILURE;
+  std::cout << "term dictionary: ok" << std::endl;
+  return EXIT_SUCCESS;
+}